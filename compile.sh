@@ -1,3 +1,3 @@
 #!/bin/sh
 
-gcc main.c -o opengl_test1 -Wall -lGL -lGLU -lglut -lGLEW -lglfw -lXxf86vm -lXrandr -lXi -ldl -lXinerama -lXcursor -lm
+gcc main.c -o opengl_test1 -Wall -lGL -lGLU -lglut -lGLEW -lglfw -lXxf86vm -lXrandr -lXi -ldl -lXinerama -lXcursor -lm -pthread
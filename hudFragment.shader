@@ -0,0 +1,14 @@
+#version 330 core
+
+in vec2 fragTexCoord;
+in vec4 fragColor;
+
+layout(location = 0) out vec4 color;
+
+uniform sampler2D atlas;
+
+void main()
+{
+	// The atlas only holds coverage, solid quads sample its white cell
+	color = vec4(fragColor.rgb, fragColor.a*texture(atlas, fragTexCoord).r);
+};
@@ -0,0 +1,17 @@
+#version 330 core
+
+layout (location = 0) in vec2 position; // Pixels from the top left
+layout (location = 1) in vec2 texCoord;
+layout (location = 2) in vec4 color;
+
+uniform vec2 screenSize;
+
+out vec2 fragTexCoord;
+out vec4 fragColor;
+
+void main()
+{
+	gl_Position = vec4(position.x/screenSize.x*2.0 - 1.0, 1.0 - position.y/screenSize.y*2.0, 0.0, 1.0);
+	fragTexCoord = texCoord;
+	fragColor = color;
+};
@@ -1,24 +1,40 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <ctype.h>
 #include <math.h>
 #include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 #include <alloca.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <signal.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define PI 3.14159265358979323846
 #define WINDOW_NAME "Guardian of the Cosmos"
 
 #define MAT_BUFFER_INDEX 2
-#define VSYNC_ON 1
 #define MAX_OBJECTS 256 // Maximum unique objects (instances do not count)
 
 // Maximum number of each object type
 // Update the vertex shader when any of these values are changed
-#define NUM_ENEMIES 6
+#define MAX_PLAYERS 4
+#define MAX_ENEMIES 1024 // Enemy pool, live ones are packed at the front
+#define NUM_START_ENEMIES 6
 #define NUM_WORMHOLES 3
 #define NUM_PLAYER_BULLETS 64
-#define NUM_ENEMY_BULLETS 128
+#define MAX_ENEMY_BULLETS 16384 // Enemy bullet pool, live ones are packed at the front
 #define NUM_ASTEROIDS 2048
 
 // How many sides in circles
@@ -34,10 +50,201 @@
 #define ENEMY_HITBOX_RAD 0.055
 #define PLAYER_BULLET_HITBOX_RAD 0.03
 #define ENEMY_BULLET_RAD 0.005
+#define WORMHOLE_HITBOX_RAD 0.1
+#define WORMHOLE_DAMAGE 0.02 // Per player bullet
+#define WAVE_INTERVAL 4.0 // Seconds between waves from each wormhole
+#define WAVE_FIRST_SIZE 3
+#define WAVE_MAX_SIZE 64
+#define WAVE_RADIUS 0.25 // Enemies come out in a ring this far from the wormhole
+#define WORMHOLE_RANGE 3.0 // Wormholes only open when a player is this close
+#define SPAWN_BENCH_FRAMES 600
+#define BULLET_BENCH_ENEMIES 1000
+#define BULLET_BENCH_FRAMES 600
+
+#define PATTERN_AIMED 0 // One bullet at the player, what enemies always used to do
+#define PATTERN_BURST 1
+#define PATTERN_SPREAD 2
+#define PATTERN_RING 3
+#define PATTERN_SPIRAL 4 // Densest, patterns go up in difficulty and waves work through them in order
+#define NUM_PATTERNS 5
+#define MAX_PATTERN_STEPS 4
+#define MAX_PATTERN_BULLETS 255 // Per volley
+#define SHAPE_SPREAD 0 // Fan of arc radians centered on the aim
+#define SHAPE_RING 1 // Evenly around a full circle
+// Frame pacing modes
+#define PACING_VSYNC 0
+#define PACING_UNCAPPED 1
+#define PACING_CAPPED 2 // Capped at frameRateCap
+#define PACING_ADAPTIVE 3 // Vsync, but tear instead of halving the frame rate when running late
+#define NUM_PACING_MODES 4
+#define MAX_FRAMES_IN_FLIGHT 4
+#define SPIN_TIME 0.002 // Sleep until this close to a deadline, then spin
+#define FENCE_TIMEOUT 100000000 // Nanoseconds
+
+// Dynamic resolution
+#define RESOLUTION_STEP 0.05 // Scale increase when there is time to spare
+#define SCALE_DOWN_THRESHOLD 0.85 // Fraction of the frame budget the GPU can use before resolution drops
+#define SCALE_UP_THRESHOLD 0.6 // ... and the fraction it has to get under before it goes back up
+#define SCALE_DOWN_FRAMES 3 // Frames over budget before dropping, react quickly to spikes
+#define SCALE_UP_FRAMES 60 // Frames under budget before raising, recover slowly
+#define LINE_WIDTH 2.0 // At full resolution
+#define NUM_TIMER_QUERIES 4 // Results are read this many frames late so they never stall
+
+#define AUDIO_NULL 0 // Mix but throw the result away
+#define AUDIO_WAV 1 // Write to audioFileName
+#define AUDIO_APLAY 2 // Pipe to aplay
+#define NUM_AUDIO_BACKENDS 3
+#define AUDIO_SAMPLE_RATE 48000
+#define AUDIO_CHANNELS 2
+#define MIX_BLOCK_FRAMES 256 // 5.3 ms, also the most a sound can be delayed by
+#define APLAY_BUFFER_TIME 20000 // Microseconds
+#define MAX_VOICES 64
+#define SOUND_QUEUE_SIZE 256 // Must be a power of 2
+#define MASTER_VOLUME 0.5
+#define AUDIO_BENCH_VOICES 1000
+#define AUDIO_BENCH_BLOCKS 2000
+
+// Sound effects, synthesized into memory at startup so that triggering one never touches the disk
+#define SOUND_PLAYER_SHOOT 0
+#define SOUND_ENEMY_SHOOT 1
+#define SOUND_HIT 2
+#define SOUND_PLAYER_HIT 3
+#define SOUND_EXPLOSION 4
+#define NUM_SOUNDS 5
+
+#define FONT_WIDTH 5
+#define FONT_HEIGHT 7
+#define ATLAS_CELL 8 // Glyphs are padded so that linear filtering could never bleed
+#define ATLAS_COLUMNS 16
+#define ATLAS_WIDTH (ATLAS_CELL*ATLAS_COLUMNS)
+#define ATLAS_HEIGHT 32
+#define HUD_MAX_QUADS 512
+#define HUD_MAX_DIRTY_RANGES 8 // Separate uploads per frame before ranges get merged
+#define HUD_MAX_TEXT 64
+#define GRAPH_SAMPLES 120 // Frames shown in the frame time graph
+#define FPS_UPDATE_INTERVAL 0.25
+
+#define TIMER_RATE 240 // Timer wheel ticks per second
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_LEVELS 3 // 64^3 ticks, about 18 minutes at 240 Hz
+#define TIMER_MAX_TICKS ((1 << (TIMER_SLOT_BITS*TIMER_LEVELS)) - 1)
+#define MAX_TIMERS (MAX_ENEMIES + 64) // One per enemy plus the rest
+
+// What a timer does when it fires, see fireTimer()
+#define TIMER_NONE 0 // Free
+#define TIMER_PLAYER_RELOAD 1
+#define TIMER_ENEMY_SHOOT 2
+#define TIMER_WORMHOLE_WAVE 3
+
+#define NUM_SNAPSHOTS 300 // Five seconds of history at 60 FPS
+#define BULLET_HISTORY (1 << 20) // Enemy bullets kept across all snapshots, rewind gets shorter with lots of bullets
+#define MAX_HITS 1024 // Collisions handled per pairing per tick
+
+// Player input, one bit per button so that it fits in a byte on the network
+#define INPUT_FORWARD 0x01
+#define INPUT_LEFT 0x02
+#define INPUT_BACK 0x04
+#define INPUT_RIGHT 0x08
+#define INPUT_TURN_LEFT 0x10
+#define INPUT_TURN_RIGHT 0x20
+#define INPUT_SLOW_TURN 0x40
+#define INPUT_SHOOT 0x80
+
+// Player status
+#define PLAYER_INACTIVE 0 // Free slot (or not connected yet)
+#define PLAYER_ALIVE 1
+#define PLAYER_DEAD 2
+#define PLAYER_OUT_OF_BOUNDS 3
+
+// Networking
+#define SERVER_PORT 27960
+#define TICK_RATE 60.0 // Server simulation and client input rate
+#define NET_ASPECT_RATIO (16.0/9.0) // Screen shape the server assumes for every client
+#define MAX_PACKET_SIZE 65000
+#define INPUT_HISTORY 64 // Client inputs kept around for prediction
+#define INPUT_REDUNDANCY 8 // Inputs resent in every packet so that a lost one doesn't matter
+#define INPUT_QUEUE 16 // Inputs buffered on the server for each client
+#define NUM_BASELINES 32 // Received states the client keeps for the server to delta against
+#define CLIENT_TIMEOUT 5.0
+#define REPORT_INTERVAL 1.0
+#define NO_TICK 0xffffffff
+#define NET_MAX_NEW_ENEMY_BULLETS 1024 // Most new enemy bullets per snapshot, the rest wait for the next one
+#define NET_MAX_BULLET_SPEED 4.0 // Enemy bullet velocities are sent as 16-bit fixed point in this range
+
+#define PACKET_INPUT 1
+#define PACKET_SNAPSHOT 2
+
+// Instance positions are uploaded as 16-bit fixed point in [-ARENA_EXTENT, ARENA_EXTENT].
+// Anything further out (e.g. the 1024 "dead" marker) is clamped to the edge, which
+// is still well off screen since the player can never leave BOUNDARY_RADIUS.
+#define ARENA_EXTENT 8.0
+
+// Vertex types, decoded by the switch in the vertex shader
+#define TYPE_PLAYER 0
+#define TYPE_RELATIVE 1 // Relative to player
+#define TYPE_WORMHOLE 2
+#define TYPE_SINGLE 3 // Relative to player (single instance)
+#define TYPE_ASTEROID 4
+
+// GPU side vertex: half-float position and an integer type (8 bytes, was 12)
+struct PackedVertex
+{
+	GLhalf x;
+	GLhalf y;
+	unsigned char type;
+	unsigned char padding[3];
+};
+
+// GPU side instance: fixed-point position and angle (6 bytes, was 12)
+struct PackedInstance
+{
+	short x;
+	short y;
+	unsigned short angle;
+};
+
+struct Timer
+{
+	unsigned int expires; // Tick it fires on
+	unsigned short type;
+	unsigned short entity;
+	unsigned short slot; // level*TIMER_SLOTS + slot, for unlinking the head of a list
+	int next; // Index in game.timers, -1 ends the list
+	int prev;
+};
+
+struct PatternStep
+{
+	unsigned char shape;
+	unsigned char count; // Bullets per volley, 0 to just wait
+	unsigned char repeat; // Volleys in this step, 0 ends the pattern
+	unsigned char isAimed; // Centered on the enemy's heading instead of straight up
+	float arc; // Spread width in radians
+	float speed;
+	float spin; // Added to the aim each volley, for spirals
+	float interval; // Seconds after each volley
+};
+
+struct Hit
+{
+	float time; // Fraction of the tick at first contact
+	unsigned int projectile;
+	unsigned int target;
+};
+
+struct Packet
+{
+	unsigned char data[MAX_PACKET_SIZE];
+	unsigned int size;
+	unsigned int readOffset;
+	int overflow; // Set if a read or write ran off the end
+};
 
 struct Object
 {
-	float *vertices;
+	float *vertices; // x, y pairs
+	unsigned int type;
 	unsigned int *indices;
 	unsigned int verticesSize;
 	unsigned int indicesSize;
@@ -54,226 +261,2892 @@ struct Object
 GLFWwindow* window;
 int* nullptr = NULL;
 float aspectRatio = 1.0;
+int screenWidth = 0;
+int screenHeight = 0;
+
+// All simulation state, kept contiguous and pointer free so that a
+// snapshot or restore is a single memcpy
+struct GameState
+{
+	unsigned char playerStatus[MAX_PLAYERS];
+	float playerLocations[3*MAX_PLAYERS];
+	float playerVelocities[2*MAX_PLAYERS];
+	float playerHealth[MAX_PLAYERS];
+	unsigned char isPlayerGunReady[MAX_PLAYERS];
+	int playerReloadTimer[MAX_PLAYERS];
+
+	unsigned int numEnemies;
+	float enemyHealth[MAX_ENEMIES];
+	float enemyLocations[3*MAX_ENEMIES];
+	float enemyVelocities[2*MAX_ENEMIES];
+	int enemyShootTimer[MAX_ENEMIES];
+	unsigned char enemyPattern[MAX_ENEMIES];
+	unsigned char enemyPatternStep[MAX_ENEMIES];
+	unsigned char enemyPatternRepeat[MAX_ENEMIES]; // Volleys fired in the current step
+
+	float wormholeInfo[3*NUM_WORMHOLES];
+	float wormholeHealth[NUM_WORMHOLES];
+	unsigned int wormholeWave[NUM_WORMHOLES]; // Waves spawned so far
+
+	float playerBulletLocations[3*NUM_PLAYER_BULLETS];
+	float playerBulletVelocities[2*NUM_PLAYER_BULLETS];
+
+	unsigned int score; // Shared by every player
+
+	// Timer wheel, see runTimers()
+	unsigned int timerTick;
+	float timerRemainder; // Fraction of a tick not run yet
+	int timerSlots[TIMER_LEVELS][TIMER_SLOTS]; // First timer in each slot
+	int freeTimer;
+	struct Timer timers[MAX_TIMERS];
+
+	// Enemy bullets have to stay last, only the live ones are copied, see copyGameState()
+	unsigned int nextEnemyBulletId;
+	unsigned int numEnemyBullets;
+	unsigned int enemyBulletIds[MAX_ENEMY_BULLETS]; // In the order they were fired, see removeDeadEnemyBullets()
+	float enemyBulletLocations[3*MAX_ENEMY_BULLETS];
+	float enemyBulletVelocities[2*MAX_ENEMY_BULLETS];
+};
+
+struct GameState game;
+
+// Ring of the most recent states, snapshots[snapshotHead] is the newest. The enemy
+// bullet pool is left off and the live bullets go in bulletHistory instead, so a
+// snapshot costs what is in play rather than the whole pool
+struct Snapshot
+{
+	unsigned char state[offsetof(struct GameState, enemyBulletIds)];
+	unsigned long firstBullet; // Where its bullets start in bulletHistory
+	unsigned int numBullets;
+};
+
+struct Snapshot snapshots[NUM_SNAPSHOTS];
+unsigned int snapshotHead = 0;
+unsigned int numSnapshots = 0;
+
+// Ring of bullets written by every snapshot one after the other, bulletHistoryEnd
+// counts every bullet ever written so older positions are easy to check
+unsigned int bulletHistoryIds[BULLET_HISTORY];
+float bulletHistoryLocations[3*BULLET_HISTORY];
+float bulletHistoryVelocities[2*BULLET_HISTORY];
+unsigned long bulletHistoryEnd = 0;
+
+unsigned int localPlayer = 0; // Player the camera follows
+unsigned char localInput = 0; // INPUT_* bits from the keyboard
+unsigned char playerInputs[MAX_PLAYERS]; // Input used for each player this frame
+int isRewinding = 0;
+int isRetrying = 0;
+
+unsigned int sceneShader;
+unsigned int sceneVAO;
+
+unsigned int VBO;
+unsigned int IBO;
+unsigned int instanceVBO;
+unsigned int VBOindex = 0;
+unsigned int IBOindex = 0;
+unsigned int instanceVBOindex = 0;
+unsigned int numObjects = 0;
+struct Object *objects[MAX_OBJECTS];
+struct PackedInstance *instanceStaging = NULL;
+struct Hit hits[MAX_HITS];
+float wormholeVelocities[2*NUM_WORMHOLES]; // Always zero, for sweepCollisions
+
+// Frame pacing
+const char *pacingModeNames[NUM_PACING_MODES] = {"vsync", "uncapped", "capped", "adaptive"};
+int pacingMode = PACING_VSYNC;
+double frameRateCap = 60.0;
+double refreshRate = 60.0;
+unsigned int framesInFlight = 2;
+GLsync frameFences[MAX_FRAMES_IN_FLIGHT];
+unsigned int fenceIndex = 0;
+double nextFrameTime = 0.0;
+int isAdaptiveTearing = 0;
+double smoothedFrameTime = 0.0;
+
+// Dynamic resolution, the scene is drawn to part of sceneFBO then scaled up to the window
+int isDynamicResolution = 1;
+float resolutionScale = 1.0;
+float minResolutionScale = 0.5;
+float maxResolutionScale = 1.0;
+unsigned int sceneFBO;
+unsigned int sceneRenderbuffer;
+unsigned int timerQueries[NUM_TIMER_QUERIES];
+float timerQueryScales[NUM_TIMER_QUERIES]; // resolutionScale each query's frame was drawn at
+unsigned int numTimerQueries = 0;
+double gpuFrameTime = 0.0;
+int framesOverBudget = 0;
+int framesUnderBudget = 0;
+
+// Frame time statistics since the last report
+unsigned int numFrameTimes = 0;
+double frameTimeSum = 0.0;
+double frameTimeSquaredSum = 0.0;
+double minFrameTime = 0.0;
+double maxFrameTime = 0.0;
+
+
+double getTime()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec*1e-9;
+}
+
+void sleepUntil(double wakeTime)
+{
+	double sleepTime = wakeTime - getTime();
+	if (sleepTime <= 0.0) return;
+	struct timespec duration = {
+		.tv_sec = (time_t)sleepTime,
+		.tv_nsec = (long)((sleepTime - (time_t)sleepTime)*1e9),
+	};
+	nanosleep(&duration, NULL);
+}
+
+void setPacingMode(int mode)
+{
+	pacingMode = mode;
+	isAdaptiveTearing = 0;
+	glfwSwapInterval((mode == PACING_VSYNC || mode == PACING_ADAPTIVE) ? 1 : 0);
+	nextFrameTime = getTime();
+}
+
+void recordFrameTime(double frameTime)
+{
+	if (numFrameTimes == 0 || frameTime < minFrameTime) minFrameTime = frameTime;
+	if (numFrameTimes == 0 || frameTime > maxFrameTime) maxFrameTime = frameTime;
+	frameTimeSum += frameTime;
+	frameTimeSquaredSum += frameTime*frameTime;
+	numFrameTimes++;
+	smoothedFrameTime = (smoothedFrameTime == 0.0) ? frameTime : 0.9*smoothedFrameTime + 0.1*frameTime;
+}
+
+void reportFrameTimes()
+{
+	if (numFrameTimes == 0) return;
+	double mean = frameTimeSum/numFrameTimes;
+	double variance = frameTimeSquaredSum/numFrameTimes - mean*mean;
+	if (variance < 0.0) variance = 0.0;
+	printf("Frame time: %.2f ms avg, %.3f ms std dev, %.2f - %.2f ms (%s, %u frames in flight)\n",
+		mean*1000.0, sqrt(variance)*1000.0, minFrameTime*1000.0, maxFrameTime*1000.0,
+		pacingModeNames[pacingMode], framesInFlight);
+	if (isDynamicResolution) {
+		printf("GPU time: %.2f ms at %.0f%% resolution\n", gpuFrameTime*1000.0, resolutionScale*100.0);
+	}
+	numFrameTimes = 0;
+	frameTimeSum = 0.0;
+	frameTimeSquaredSum = 0.0;
+}
+
+// Sleep most of the way then spin, sleeping alone overshoots by up to a scheduler tick
+void waitUntil(double deadline)
+{
+	sleepUntil(deadline - SPIN_TIME);
+	while (getTime() < deadline);
+}
+
+// Swap buffers at the time the pacing mode wants, without letting the driver queue
+// more than framesInFlight frames ahead of the GPU
+void presentFrame()
+{
+	if (pacingMode == PACING_CAPPED) {
+		nextFrameTime += 1.0/frameRateCap;
+		double now = getTime();
+		if (nextFrameTime < now - 1.0/frameRateCap) {
+			nextFrameTime = now; // Too far behind, don't try to catch up
+		}
+		waitUntil(nextFrameTime);
+	} else if (pacingMode == PACING_ADAPTIVE) {
+		// Drop vsync while we can't keep up with the display, bring it back once we can
+		double refreshPeriod = 1.0/refreshRate;
+		if (!isAdaptiveTearing && smoothedFrameTime > 1.05*refreshPeriod) {
+			isAdaptiveTearing = 1;
+			glfwSwapInterval(0);
+		} else if (isAdaptiveTearing && smoothedFrameTime < 0.9*refreshPeriod) {
+			isAdaptiveTearing = 0;
+			glfwSwapInterval(1);
+		}
+	}
+
+	glfwSwapBuffers(window);
+
+	frameFences[fenceIndex] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	fenceIndex = (fenceIndex + 1) % framesInFlight;
+	if (frameFences[fenceIndex]) {
+		glClientWaitSync(frameFences[fenceIndex], GL_SYNC_FLUSH_COMMANDS_BIT, FENCE_TIMEOUT);
+		glDeleteSync(frameFences[fenceIndex]);
+		frameFences[fenceIndex] = 0;
+	}
+}
+
+int initDynamicResolution()
+{
+	glGenRenderbuffers(1, &sceneRenderbuffer);
+	glBindRenderbuffer(GL_RENDERBUFFER, sceneRenderbuffer);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, screenWidth, screenHeight);
+
+	glGenFramebuffers(1, &sceneFBO);
+	glBindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, sceneRenderbuffer);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		printf("Offscreen framebuffer incomplete, dynamic resolution disabled\n");
+		isDynamicResolution = 0;
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	glGenQueries(NUM_TIMER_QUERIES, timerQueries);
+	resolutionScale = maxResolutionScale;
+	return 0;
+}
+
+// GPU time of the frame from NUM_TIMER_QUERIES - 1 frames ago. Returns 0 if it isn't
+// finished yet or was drawn at a different scale, since those say nothing about this one
+int readGPUFrameTime()
+{
+	if (numTimerQueries < NUM_TIMER_QUERIES) return 0;
+	unsigned int index = numTimerQueries % NUM_TIMER_QUERIES;
+	int isAvailable = 0;
+	glGetQueryObjectiv(timerQueries[index], GL_QUERY_RESULT_AVAILABLE, &isAvailable);
+	if (!isAvailable) return 0;
+	GLuint64 elapsed;
+	glGetQueryObjectui64v(timerQueries[index], GL_QUERY_RESULT, &elapsed);
+	if (timerQueryScales[index] != resolutionScale) return 0;
+	gpuFrameTime = elapsed*1e-9;
+	return 1;
+}
+
+// Drop resolution quickly when the GPU can't keep up, raise it slowly once it can.
+// Only called with a new gpuFrameTime
+void updateResolutionScale()
+{
+	if (gpuFrameTime <= 0.0) return;
+	double budget = (pacingMode == PACING_CAPPED) ? 1.0/frameRateCap : 1.0/refreshRate;
+	if (gpuFrameTime > SCALE_DOWN_THRESHOLD*budget) {
+		framesOverBudget++;
+		framesUnderBudget = 0;
+	} else if (gpuFrameTime < SCALE_UP_THRESHOLD*budget) {
+		framesUnderBudget++;
+		framesOverBudget = 0;
+	} else {
+		framesOverBudget = 0;
+		framesUnderBudget = 0;
+	}
+
+	if (framesOverBudget >= SCALE_DOWN_FRAMES) {
+		// Fill cost goes with the number of pixels, so aim straight for the middle of the band
+		double target = 0.5*(SCALE_DOWN_THRESHOLD + SCALE_UP_THRESHOLD)*budget;
+		resolutionScale *= sqrt(target/gpuFrameTime);
+		framesOverBudget = 0;
+	} else if (framesUnderBudget >= SCALE_UP_FRAMES) {
+		resolutionScale += RESOLUTION_STEP;
+		framesUnderBudget = 0;
+	}
+	if (resolutionScale < minResolutionScale) resolutionScale = minResolutionScale;
+	if (resolutionScale > maxResolutionScale) resolutionScale = maxResolutionScale;
+}
+
+/* Audio */
+
+struct Sound
+{
+	float *samples; // Mono, padded with a block of silence so the mixer never needs a bounds check
+	unsigned int length; // Without the padding
+};
+
+struct SoundEvent
+{
+	unsigned char sound;
+	float volume;
+	float pan; // -1.0 left to 1.0 right
+};
+
+struct Voice
+{
+	unsigned int sound;
+	unsigned int position;
+	float gainLeft;
+	float gainRight;
+	int isActive;
+};
+
+// Single producer (game thread), single consumer (mixer thread) ring.
+// Each side only writes its own index, so pushing is a store and a release
+struct SoundQueue
+{
+	struct SoundEvent events[SOUND_QUEUE_SIZE];
+	_Atomic unsigned int head; // Written by the game thread
+	_Atomic unsigned int tail; // Written by the mixer thread
+};
+
+const char *audioBackendNames[NUM_AUDIO_BACKENDS] = {"null", "wav", "aplay"};
+int audioBackend = AUDIO_NULL;
+char *audioFileName = "audio.wav";
+struct Sound sounds[NUM_SOUNDS];
+struct SoundQueue soundQueue;
+struct Voice voices[MAX_VOICES];
+_Atomic int isMixerRunning = 0;
+_Atomic unsigned int droppedSoundEvents = 0;
+int isAudioOutputBroken = 0; // Mixer thread only
+pthread_t mixerThread;
+FILE *audioOutput = NULL;
+unsigned int audioFramesWritten = 0;
+
+// Small deterministic noise source, so sounds don't depend on rand()
+float noise(unsigned int *seed)
+{
+	*seed = *seed*1664525 + 1013904223;
+	return (float)(*seed >> 8)/(float)(1 << 23) - 1.0;
+}
+
+void createSound(unsigned int sound, float duration)
+{
+	sounds[sound].length = duration*AUDIO_SAMPLE_RATE;
+	sounds[sound].samples = calloc(sounds[sound].length + MIX_BLOCK_FRAMES, sizeof(float));
+}
+
+int initSounds()
+{
+	unsigned int seed = 1;
+	float phase;
+
+	// Falling square wave chirps for shots
+	float shootFrequencies[2][2] = {{1400.0, 300.0}, {500.0, 150.0}};
+	float shootDurations[2] = {0.08, 0.12};
+	for (int i = 0; i < 2; i++) {
+		createSound(SOUND_PLAYER_SHOOT + i, shootDurations[i]);
+		struct Sound *sound = &sounds[SOUND_PLAYER_SHOOT + i];
+		phase = 0.0;
+		for (int j = 0; j < sound->length; j++) {
+			float t = (float)j/sound->length;
+			phase += (shootFrequencies[i][0] + (shootFrequencies[i][1] - shootFrequencies[i][0])*t)/AUDIO_SAMPLE_RATE;
+			float square = (phase - floor(phase) < 0.5) ? 1.0 : -1.0;
+			sound->samples[j] = 0.2*square*(1.0 - t);
+		}
+	}
+
+	// Short noise burst when a bullet hits an enemy
+	createSound(SOUND_HIT, 0.05);
+	for (int j = 0; j < sounds[SOUND_HIT].length; j++) {
+		float t = (float)j/sounds[SOUND_HIT].length;
+		sounds[SOUND_HIT].samples[j] = 0.3*noise(&seed)*(1.0 - t)*(1.0 - t);
+	}
+
+	// Low thud when the player gets hit
+	createSound(SOUND_PLAYER_HIT, 0.25);
+	phase = 0.0;
+	for (int j = 0; j < sounds[SOUND_PLAYER_HIT].length; j++) {
+		float t = (float)j/sounds[SOUND_PLAYER_HIT].length;
+		phase += (160.0 - 110.0*t)/AUDIO_SAMPLE_RATE;
+		sounds[SOUND_PLAYER_HIT].samples[j] = 0.5*sin(2*PI*phase)*(1.0 - t);
+	}
+
+	// Explosion, noise that gets darker as it fades
+	createSound(SOUND_EXPLOSION, 0.8);
+	float filtered = 0.0;
+	for (int j = 0; j < sounds[SOUND_EXPLOSION].length; j++) {
+		float t = (float)j/sounds[SOUND_EXPLOSION].length;
+		float cutoff = 0.3*(1.0 - t) + 0.01;
+		filtered += (noise(&seed) - filtered)*cutoff;
+		sounds[SOUND_EXPLOSION].samples[j] = 1.2*filtered*(1.0 - t)*(1.0 - t);
+	}
+	return 0;
+}
+
+// Game thread: never blocks, never allocates, drops the sound if the mixer is behind
+void playSound(unsigned int sound, float volume, float pan)
+{
+	if (!isMixerRunning) return;
+	unsigned int head = atomic_load_explicit(&soundQueue.head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&soundQueue.tail, memory_order_acquire);
+	if (head - tail >= SOUND_QUEUE_SIZE) {
+		atomic_fetch_add_explicit(&droppedSoundEvents, 1, memory_order_relaxed);
+		return;
+	}
+	struct SoundEvent *event = &soundQueue.events[head % SOUND_QUEUE_SIZE];
+	event->sound = sound;
+	event->volume = volume;
+	event->pan = pan;
+	atomic_store_explicit(&soundQueue.head, head + 1, memory_order_release);
+}
+
+// Pan by where the sound happened relative to the local player
+void playSoundAt(unsigned int sound, float x, float volume)
+{
+	float pan = (x - game.playerLocations[localPlayer*3])/aspectRatio;
+	if (pan < -1.0) pan = -1.0;
+	if (pan > 1.0) pan = 1.0;
+	playSound(sound, volume, pan);
+}
+
+void startVoice(struct Voice *voices, unsigned int numVoices, struct SoundEvent *event)
+{
+	// Take a free voice, or steal the one that has played the longest
+	struct Voice *voice = &voices[0];
+	for (int i = 0; i < numVoices; i++) {
+		if (!voices[i].isActive) {
+			voice = &voices[i];
+			break;
+		}
+		if (voices[i].position > voice->position) voice = &voices[i];
+	}
+	// Constant power panning
+	float angle = (event->pan + 1.0)*0.25*PI;
+	voice->sound = event->sound;
+	voice->position = 0;
+	voice->gainLeft = event->volume*cos(angle);
+	voice->gainRight = event->volume*sin(angle);
+	voice->isActive = 1;
+}
+
+void mixVoiceScalar(const float *samples, float gainLeft, float gainRight, float *left, float *right)
+{
+	for (int i = 0; i < MIX_BLOCK_FRAMES; i++) {
+		left[i] += samples[i]*gainLeft;
+		right[i] += samples[i]*gainRight;
+	}
+}
+
+void mixVoice(const float *samples, float gainLeft, float gainRight, float *left, float *right)
+{
+#ifdef __SSE2__
+	__m128 gainL = _mm_set1_ps(gainLeft);
+	__m128 gainR = _mm_set1_ps(gainRight);
+	for (int i = 0; i < MIX_BLOCK_FRAMES; i += 4) {
+		__m128 sample = _mm_loadu_ps(&samples[i]);
+		_mm_store_ps(&left[i], _mm_add_ps(_mm_load_ps(&left[i]), _mm_mul_ps(sample, gainL)));
+		_mm_store_ps(&right[i], _mm_add_ps(_mm_load_ps(&right[i]), _mm_mul_ps(sample, gainR)));
+	}
+#else
+	mixVoiceScalar(samples, gainLeft, gainRight, left, right);
+#endif
+}
+
+// Mix one block of every active voice into interleaved 16 bit stereo
+void mixBlock(struct Voice *voices, unsigned int numVoices, short *output, int useSIMD)
+{
+	static _Alignas(16) float left[MIX_BLOCK_FRAMES];
+	static _Alignas(16) float right[MIX_BLOCK_FRAMES];
+	memset(left, 0, sizeof(left));
+	memset(right, 0, sizeof(right));
+
+	for (int i = 0; i < numVoices; i++) {
+		struct Voice *voice = &voices[i];
+		if (!voice->isActive) continue;
+		struct Sound *sound = &sounds[voice->sound];
+		const float *samples = &sound->samples[voice->position];
+		if (useSIMD) {
+			mixVoice(samples, voice->gainLeft, voice->gainRight, left, right);
+		} else {
+			mixVoiceScalar(samples, voice->gainLeft, voice->gainRight, left, right);
+		}
+		voice->position += MIX_BLOCK_FRAMES;
+		if (voice->position >= sound->length) voice->isActive = 0;
+	}
+
+	// Convert with saturation, so a pile of explosions clips instead of wrapping
+#ifdef __SSE2__
+	if (useSIMD) {
+		__m128 scale = _mm_set1_ps(MASTER_VOLUME*32767.0);
+		for (int i = 0; i < MIX_BLOCK_FRAMES; i += 4) {
+			__m128i l = _mm_cvtps_epi32(_mm_mul_ps(_mm_load_ps(&left[i]), scale));
+			__m128i r = _mm_cvtps_epi32(_mm_mul_ps(_mm_load_ps(&right[i]), scale));
+			__m128i packed = _mm_packs_epi32(l, r); // l0 l1 l2 l3 r0 r1 r2 r3
+			_mm_storeu_si128((__m128i *)&output[i*2], _mm_unpacklo_epi16(packed, _mm_unpackhi_epi64(packed, packed)));
+		}
+		return;
+	}
+#endif
+	for (int i = 0; i < MIX_BLOCK_FRAMES; i++) {
+		float l = left[i]*MASTER_VOLUME*32767.0;
+		float r = right[i]*MASTER_VOLUME*32767.0;
+		output[i*2] = (l > 32767.0) ? 32767 : (l < -32768.0) ? -32768 : (short)lrintf(l);
+		output[i*2 + 1] = (r > 32767.0) ? 32767 : (r < -32768.0) ? -32768 : (short)lrintf(r);
+	}
+}
+
+void writeLittleEndian(FILE *file, unsigned int value, int numBytes)
+{
+	for (int i = 0; i < numBytes; i++) fputc((value >> (i*8)) & 0xff, file);
+}
+
+void writeWavHeader(FILE *file, unsigned int numFrames)
+{
+	unsigned int dataSize = numFrames*AUDIO_CHANNELS*2;
+	fwrite("RIFF", 1, 4, file);
+	writeLittleEndian(file, 36 + dataSize, 4);
+	fwrite("WAVEfmt ", 1, 8, file);
+	writeLittleEndian(file, 16, 4); // Format chunk size
+	writeLittleEndian(file, 1, 2); // PCM
+	writeLittleEndian(file, AUDIO_CHANNELS, 2);
+	writeLittleEndian(file, AUDIO_SAMPLE_RATE, 4);
+	writeLittleEndian(file, AUDIO_SAMPLE_RATE*AUDIO_CHANNELS*2, 4);
+	writeLittleEndian(file, AUDIO_CHANNELS*2, 2);
+	writeLittleEndian(file, 16, 2);
+	fwrite("data", 1, 4, file);
+	writeLittleEndian(file, dataSize, 4);
+}
+
+void writeAudioBlock(short *block)
+{
+	if (audioBackend == AUDIO_NULL || isAudioOutputBroken) return;
+	// The samples are already little endian on every platform this runs on
+	if (fwrite(block, sizeof(short), MIX_BLOCK_FRAMES*AUDIO_CHANNELS, audioOutput) < MIX_BLOCK_FRAMES*AUDIO_CHANNELS) {
+		printf("Audio output failed, continuing without sound\n");
+		isAudioOutputBroken = 1;
+		return;
+	}
+	audioFramesWritten += MIX_BLOCK_FRAMES;
+}
+
+void *runMixer(void *argument)
+{
+	short block[MIX_BLOCK_FRAMES*AUDIO_CHANNELS];
+	double blockTime = (double)MIX_BLOCK_FRAMES/AUDIO_SAMPLE_RATE;
+	double nextBlockTime = getTime();
+	while (isMixerRunning) {
+		// Start a voice for everything the game asked for since the last block
+		unsigned int tail = atomic_load_explicit(&soundQueue.tail, memory_order_relaxed);
+		unsigned int head = atomic_load_explicit(&soundQueue.head, memory_order_acquire);
+		for (; tail != head; tail++) {
+			startVoice(voices, MAX_VOICES, &soundQueue.events[tail % SOUND_QUEUE_SIZE]);
+		}
+		atomic_store_explicit(&soundQueue.tail, tail, memory_order_release);
+
+		mixBlock(voices, MAX_VOICES, block, 1);
+		writeAudioBlock(block);
+
+		// aplay blocks on its own buffer, the others have to keep time themselves
+		if (audioBackend != AUDIO_APLAY || isAudioOutputBroken) {
+			nextBlockTime += blockTime;
+			double now = getTime();
+			if (nextBlockTime < now - blockTime) nextBlockTime = now; // Fell behind, don't try to catch up
+			sleepUntil(nextBlockTime);
+		}
+	}
+	return NULL;
+}
+
+void stopAudio()
+{
+	if (!isMixerRunning) return;
+	isMixerRunning = 0;
+	pthread_join(mixerThread, NULL);
+	if (audioBackend == AUDIO_WAV) {
+		// Now that the length is known, fill it in
+		fseek(audioOutput, 0, SEEK_SET);
+		writeWavHeader(audioOutput, audioFramesWritten);
+		fclose(audioOutput);
+	} else if (audioBackend == AUDIO_APLAY) {
+		pclose(audioOutput);
+	}
+	if (droppedSoundEvents > 0) printf("Audio: %u sound events dropped\n", droppedSoundEvents);
+}
+
+int startAudio()
+{
+	initSounds();
+	if (audioBackend == AUDIO_WAV) {
+		audioOutput = fopen(audioFileName, "wb");
+		if (audioOutput == NULL) {
+			printf("Could not open %s\n", audioFileName);
+			return -1;
+		}
+		writeWavHeader(audioOutput, 0);
+	} else if (audioBackend == AUDIO_APLAY) {
+		char command[128];
+		snprintf(command, sizeof(command), "aplay -q -t raw -f S16_LE -c %d -r %d --buffer-time=%d", AUDIO_CHANNELS, AUDIO_SAMPLE_RATE, APLAY_BUFFER_TIME);
+		signal(SIGPIPE, SIG_IGN); // Carry on silently if aplay goes away
+		audioOutput = popen(command, "w");
+		if (audioOutput == NULL) {
+			printf("Could not start aplay\n");
+			return -1;
+		}
+	}
+
+	isMixerRunning = 1;
+	if (pthread_create(&mixerThread, NULL, runMixer, NULL) != 0) {
+		printf("Could not start the mixer thread\n");
+		isMixerRunning = 0;
+		return -1;
+	}
+	// Real-time priority if we're allowed it, otherwise a normal thread is fine
+	struct sched_param priority = {.sched_priority = sched_get_priority_min(SCHED_FIFO)};
+	pthread_setschedparam(mixerThread, SCHED_FIFO, &priority);
+	atexit(stopAudio);
+	return 0;
+}
+
+// Mixer CPU time with AUDIO_BENCH_VOICES voices, scalar and SIMD, through the same path the game uses
+int runAudioBenchmark()
+{
+	initSounds();
+	if (audioBackend == AUDIO_WAV) {
+		audioOutput = fopen(audioFileName, "wb");
+		if (audioOutput == NULL) {
+			printf("Could not open %s\n", audioFileName);
+			return -1;
+		}
+		writeWavHeader(audioOutput, 0);
+	} else {
+		audioBackend = AUDIO_NULL;
+	}
+
+	static struct Voice benchVoices[AUDIO_BENCH_VOICES];
+	short block[MIX_BLOCK_FRAMES*AUDIO_CHANNELS];
+	double blockTime = (double)MIX_BLOCK_FRAMES/AUDIO_SAMPLE_RATE;
+	for (int useSIMD = 0; useSIMD <= 1; useSIMD++) {
+		unsigned int seed = 1;
+		for (int i = 0; i < AUDIO_BENCH_VOICES; i++) {
+			struct SoundEvent event = {i % NUM_SOUNDS, 1.0/AUDIO_BENCH_VOICES, noise(&seed)};
+			benchVoices[i].isActive = 0;
+			startVoice(&benchVoices[i], 1, &event);
+		}
+		struct timespec start, end;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+		for (int i = 0; i < AUDIO_BENCH_BLOCKS; i++) {
+			mixBlock(benchVoices, AUDIO_BENCH_VOICES, block, useSIMD);
+			if (useSIMD) writeAudioBlock(block);
+			// Keep every voice playing so the load is constant
+			for (int j = 0; j < AUDIO_BENCH_VOICES; j++) {
+				benchVoices[j].isActive = 1;
+				if (benchVoices[j].position >= sounds[benchVoices[j].sound].length) benchVoices[j].position = 0;
+			}
+		}
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+		double cpuTime = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)*1e-9;
+		double blockCPUTime = cpuTime/AUDIO_BENCH_BLOCKS;
+		printf("%s: %.2f us of CPU per %d frame block with %d voices, %.2f%% of real time\n",
+			useSIMD ? "SIMD  " : "Scalar", blockCPUTime*1e6, MIX_BLOCK_FRAMES, AUDIO_BENCH_VOICES, blockCPUTime/blockTime*100.0);
+	}
+
+	if (audioBackend == AUDIO_WAV) {
+		fseek(audioOutput, 0, SEEK_SET);
+		writeWavHeader(audioOutput, audioFramesWritten);
+		fclose(audioOutput);
+	}
+	return 0;
+}
+
+/* HUD */
+
+// Character for each glyph in font[], in atlas order
+const char *fontCharacters = " ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789.:%/-!";
+
+// 5x7 bitmap font, one byte per row with the leftmost pixel in bit 4
+const unsigned char font[][FONT_HEIGHT] = {
+	{0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // Space
+	{0x0E, 0x11, 0x11, 0x1F, 0x11, 0x11, 0x11}, // A
+	{0x1E, 0x11, 0x11, 0x1E, 0x11, 0x11, 0x1E},
+	{0x0E, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0E},
+	{0x1C, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1C},
+	{0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x1F},
+	{0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x10},
+	{0x0E, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0F},
+	{0x11, 0x11, 0x11, 0x1F, 0x11, 0x11, 0x11},
+	{0x0E, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0E},
+	{0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0C},
+	{0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11},
+	{0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1F},
+	{0x11, 0x1B, 0x15, 0x15, 0x11, 0x11, 0x11},
+	{0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11},
+	{0x0E, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E},
+	{0x1E, 0x11, 0x11, 0x1E, 0x10, 0x10, 0x10},
+	{0x0E, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0D},
+	{0x1E, 0x11, 0x11, 0x1E, 0x14, 0x12, 0x11},
+	{0x0F, 0x10, 0x10, 0x0E, 0x01, 0x01, 0x1E},
+	{0x1F, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04},
+	{0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E},
+	{0x11, 0x11, 0x11, 0x11, 0x11, 0x0A, 0x04},
+	{0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0A},
+	{0x11, 0x11, 0x0A, 0x04, 0x0A, 0x11, 0x11},
+	{0x11, 0x11, 0x11, 0x0A, 0x04, 0x04, 0x04},
+	{0x1F, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1F}, // Z
+	{0x0E, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0E}, // 0
+	{0x04, 0x0C, 0x04, 0x04, 0x04, 0x04, 0x0E},
+	{0x0E, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1F},
+	{0x1F, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0E},
+	{0x02, 0x06, 0x0A, 0x12, 0x1F, 0x02, 0x02},
+	{0x1F, 0x10, 0x1E, 0x01, 0x01, 0x11, 0x0E},
+	{0x06, 0x08, 0x10, 0x1E, 0x11, 0x11, 0x0E},
+	{0x1F, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08},
+	{0x0E, 0x11, 0x11, 0x0E, 0x11, 0x11, 0x0E},
+	{0x0E, 0x11, 0x11, 0x0F, 0x01, 0x02, 0x0C}, // 9
+	{0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C}, // .
+	{0x00, 0x0C, 0x0C, 0x00, 0x0C, 0x0C, 0x00}, // :
+	{0x18, 0x19, 0x02, 0x04, 0x08, 0x13, 0x03}, // %
+	{0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x00}, // /
+	{0x00, 0x00, 0x00, 0x1F, 0x00, 0x00, 0x00}, // -
+	{0x04, 0x04, 0x04, 0x04, 0x04, 0x00, 0x04}, // !
+};
+#define NUM_GLYPHS (sizeof(font)/sizeof(font[0]))
+#define WHITE_GLYPH NUM_GLYPHS // Solid cell after the font, used for bars
+
+// Where each HUD piece lives in the vertex stream, so that it can be rebuilt on its own
+struct HudText
+{
+	unsigned int firstQuad;
+	unsigned int maxChars;
+	float x;
+	float y;
+	float scale; // Screen pixels per font pixel
+	int isCentered;
+	unsigned char color[4];
+	char text[HUD_MAX_TEXT];
+};
+
+struct HudVertex
+{
+	float x;
+	float y;
+	unsigned short u;
+	unsigned short v;
+	unsigned char color[4];
+};
+
+unsigned int hudShader;
+unsigned int hudVAO;
+unsigned int hudVBO;
+unsigned int hudAtlas;
+unsigned char glyphIndex[128];
+struct HudVertex hudVertices[6*HUD_MAX_QUADS];
+unsigned int numHudQuads = 0;
+unsigned int dirtyFirstQuads[HUD_MAX_DIRTY_RANGES]; // Ranges that need uploading
+unsigned int dirtyEndQuads[HUD_MAX_DIRTY_RANGES];
+unsigned int numDirtyRanges = 0;
+float hudScale = 1.0;
+
+struct HudText healthText;
+struct HudText scoreText;
+struct HudText fpsText;
+struct HudText messageText;
+struct HudText subMessageText;
+unsigned int healthBarQuad;
+unsigned int graphQuad;
+unsigned int graphColumn = 0;
+float graphMaxTime = 1.0/30.0; // Frame time at the top of the graph
+
+unsigned int allocateHudQuads(unsigned int count)
+{
+	unsigned int firstQuad = numHudQuads;
+	numHudQuads += count;
+	if (numHudQuads > HUD_MAX_QUADS) {
+		printf("Maximum number of HUD quads exceeded (%d)\n", HUD_MAX_QUADS);
+		exit(-1);
+	}
+	return firstQuad;
+}
+
+// Grow a range this quad is in or next to, otherwise start a new one. Far apart
+// quads (like the graph's column and the text) then don't drag everything between
+// them into the upload
+void markHudQuadDirty(unsigned int quad)
+{
+	for (int i = 0; i < numDirtyRanges; i++) {
+		if (quad + 1 < dirtyFirstQuads[i] || quad > dirtyEndQuads[i]) continue;
+		if (quad < dirtyFirstQuads[i]) dirtyFirstQuads[i] = quad;
+		if (quad + 1 > dirtyEndQuads[i]) dirtyEndQuads[i] = quad + 1;
+		return;
+	}
+	if (numDirtyRanges == HUD_MAX_DIRTY_RANGES) {
+		// Out of ranges, widen the last one to cover it
+		unsigned int last = HUD_MAX_DIRTY_RANGES - 1;
+		if (quad < dirtyFirstQuads[last]) dirtyFirstQuads[last] = quad;
+		if (quad + 1 > dirtyEndQuads[last]) dirtyEndQuads[last] = quad + 1;
+		return;
+	}
+	dirtyFirstQuads[numDirtyRanges] = quad;
+	dirtyEndQuads[numDirtyRanges] = quad + 1;
+	numDirtyRanges++;
+}
+
+// Rectangle in pixels showing one atlas cell, a zero sized one hides the quad
+void setHudQuad(unsigned int quad, float x0, float y0, float x1, float y1, unsigned int glyph, const unsigned char *color)
+{
+	unsigned short u0 = (glyph % ATLAS_COLUMNS)*ATLAS_CELL*65535/ATLAS_WIDTH;
+	unsigned short v0 = (glyph / ATLAS_COLUMNS)*ATLAS_CELL*65535/ATLAS_HEIGHT;
+	unsigned short u1 = u0 + FONT_WIDTH*65535/ATLAS_WIDTH;
+	unsigned short v1 = v0 + FONT_HEIGHT*65535/ATLAS_HEIGHT;
+	struct HudVertex corners[4] = {
+		{x0, y0, u0, v0},
+		{x1, y0, u1, v0},
+		{x1, y1, u1, v1},
+		{x0, y1, u0, v1},
+	};
+	int order[6] = {0, 1, 2, 0, 2, 3};
+	for (int i = 0; i < 6; i++) {
+		hudVertices[quad*6 + i] = corners[order[i]];
+		memcpy(hudVertices[quad*6 + i].color, color, 4);
+	}
+	markHudQuadDirty(quad);
+}
+
+void initHudText(struct HudText *hudText, unsigned int maxChars, float x, float y, float scale, int isCentered, const unsigned char *color)
+{
+	hudText->firstQuad = allocateHudQuads(maxChars);
+	hudText->maxChars = maxChars;
+	hudText->x = x;
+	hudText->y = y;
+	hudText->scale = scale;
+	hudText->isCentered = isCentered;
+	memcpy(hudText->color, color, 4);
+	hudText->text[0] = '\0';
+	for (int i = 0; i < maxChars; i++) {
+		setHudQuad(hudText->firstQuad + i, 0, 0, 0, 0, 0, color);
+	}
+}
+
+// Only rebuilds the text's quads when the string actually changed
+void setHudText(struct HudText *hudText, const char *text)
+{
+	if (!strncmp(hudText->text, text, HUD_MAX_TEXT - 1)) return;
+	strncpy(hudText->text, text, HUD_MAX_TEXT - 1);
+	hudText->text[HUD_MAX_TEXT - 1] = '\0';
+
+	unsigned int length = strlen(hudText->text);
+	if (length > hudText->maxChars) length = hudText->maxChars;
+	float advance = (FONT_WIDTH + 1)*hudText->scale;
+	float x = hudText->isCentered ? hudText->x - 0.5*length*advance : hudText->x;
+	for (int i = 0; i < hudText->maxChars; i++) {
+		unsigned int quad = hudText->firstQuad + i;
+		if (i >= length) {
+			setHudQuad(quad, 0, 0, 0, 0, 0, hudText->color);
+			continue;
+		}
+		unsigned int glyph = glyphIndex[hudText->text[i] & 0x7f];
+		float x0 = x + i*advance;
+		setHudQuad(quad, x0, hudText->y, x0 + FONT_WIDTH*hudText->scale, hudText->y + FONT_HEIGHT*hudText->scale, glyph, hudText->color);
+	}
+}
+
+// Builds the atlas and the static parts of the HUD, hudShader has to be compiled first
+int initHud()
+{
+	// Glyph atlas
+	for (int i = 0; i < 128; i++) glyphIndex[i] = 0;
+	for (int i = 0; fontCharacters[i] != '\0'; i++) {
+		glyphIndex[(int)fontCharacters[i]] = i;
+		glyphIndex[tolower(fontCharacters[i])] = i;
+	}
+	unsigned char *atlas = calloc(ATLAS_WIDTH*ATLAS_HEIGHT, 1);
+	for (int glyph = 0; glyph <= WHITE_GLYPH; glyph++) {
+		int cellX = (glyph % ATLAS_COLUMNS)*ATLAS_CELL;
+		int cellY = (glyph / ATLAS_COLUMNS)*ATLAS_CELL;
+		for (int y = 0; y < FONT_HEIGHT; y++) {
+			for (int x = 0; x < FONT_WIDTH; x++) {
+				int isSet = glyph == WHITE_GLYPH || (font[glyph][y] >> (FONT_WIDTH - 1 - x)) & 1;
+				atlas[(cellY + y)*ATLAS_WIDTH + cellX + x] = isSet ? 255 : 0;
+			}
+		}
+	}
+	glGenTextures(1, &hudAtlas);
+	glBindTexture(GL_TEXTURE_2D, hudAtlas);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, ATLAS_WIDTH, ATLAS_HEIGHT, 0, GL_RED, GL_UNSIGNED_BYTE, atlas);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	free(atlas);
+
+	glUseProgram(hudShader);
+	glUniform2f(glGetUniformLocation(hudShader, "screenSize"), screenWidth, screenHeight);
+	glUniform1i(glGetUniformLocation(hudShader, "atlas"), 0);
+
+	// Layout, sized off the screen height so that it looks the same everywhere
+	hudScale = floor(screenHeight/270.0);
+	if (hudScale < 1.0) hudScale = 1.0;
+	float margin = 4*hudScale;
+	float lineHeight = (FONT_HEIGHT + 3)*hudScale;
+	float advance = (FONT_WIDTH + 1)*hudScale;
+	unsigned char textColor[4] = {160, 180, 255, 255};
+	unsigned char messageColor[4] = {255, 255, 255, 255};
+
+	initHudText(&healthText, 8, margin, margin, hudScale, 0, textColor);
+	setHudText(&healthText, "HEALTH");
+	healthBarQuad = allocateHudQuads(2); // Background, fill
+	initHudText(&scoreText, 16, screenWidth - margin - 16*advance, margin, hudScale, 0, textColor);
+	initHudText(&fpsText, 24, margin, screenHeight - margin - FONT_HEIGHT*hudScale, hudScale, 0, textColor);
+	graphQuad = allocateHudQuads(GRAPH_SAMPLES + 1); // Budget line, samples
+	initHudText(&messageText, 24, 0.5*screenWidth, 0.5*screenHeight - 2*lineHeight, 2*hudScale, 1, messageColor);
+	initHudText(&subMessageText, 32, 0.5*screenWidth, 0.5*screenHeight, hudScale, 1, textColor);
+	for (int i = 0; i < GRAPH_SAMPLES + 1; i++) {
+		setHudQuad(graphQuad + i, 0, 0, 0, 0, 0, textColor);
+	}
+
+	glGenVertexArrays(1, &hudVAO);
+	glBindVertexArray(hudVAO);
+	glGenBuffers(1, &hudVBO);
+	glBindBuffer(GL_ARRAY_BUFFER, hudVBO);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(hudVertices), NULL, GL_DYNAMIC_DRAW);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(struct HudVertex), (void*)offsetof(struct HudVertex, x));
+	glEnableVertexAttribArray(1);
+	glVertexAttribPointer(1, 2, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(struct HudVertex), (void*)offsetof(struct HudVertex, u));
+	glEnableVertexAttribArray(2);
+	glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(struct HudVertex), (void*)offsetof(struct HudVertex, color));
+
+	glBindVertexArray(sceneVAO);
+	glUseProgram(sceneShader);
+	return 0;
+}
+
+void setHealthBar(float health)
+{
+	static float lastHealth = -1.0;
+	if (health == lastHealth) return;
+	lastHealth = health;
+	if (health < 0.0) health = 0.0;
+	unsigned char backColor[4] = {60, 60, 90, 160};
+	unsigned char fillColor[4] = {255, 70, 90, 255};
+	float x = 4*hudScale;
+	float y = x + (FONT_HEIGHT + 2)*hudScale;
+	float width = 60*hudScale;
+	float height = 3*hudScale;
+	setHudQuad(healthBarQuad, x, y, x + width, y + height, WHITE_GLYPH, backColor);
+	setHudQuad(healthBarQuad + 1, x, y, x + width*health, y + height, WHITE_GLYPH, fillColor);
+}
+
+// Frame time graph that sweeps left to right, so each frame only touches two columns
+// (and the budget line when the budget changes)
+void addGraphSample(double frameTime, double budget)
+{
+	static double lastBudget = -1.0;
+	unsigned char goodColor[4] = {90, 220, 120, 200};
+	unsigned char slowColor[4] = {255, 80, 80, 230};
+	unsigned char budgetColor[4] = {255, 255, 255, 90};
+	float left = 4*hudScale;
+	float bottom = screenHeight - (4 + FONT_HEIGHT + 3)*hudScale;
+	float height = 30*hudScale;
+	float columnWidth = ceil(0.5*hudScale);
+
+	if (budget != lastBudget) {
+		float budgetY = bottom - height*budget/graphMaxTime;
+		setHudQuad(graphQuad, left, budgetY, left + GRAPH_SAMPLES*columnWidth, budgetY + 1, WHITE_GLYPH, budgetColor);
+		lastBudget = budget;
+	}
+
+	float sampleHeight = height*frameTime/graphMaxTime;
+	if (sampleHeight > height) sampleHeight = height;
+	float x = left + graphColumn*columnWidth;
+	setHudQuad(graphQuad + 1 + graphColumn, x, bottom - sampleHeight, x + columnWidth, bottom, WHITE_GLYPH, (frameTime > budget) ? slowColor : goodColor);
+	graphColumn = (graphColumn + 1) % GRAPH_SAMPLES;
+	// Blank the next column as a cursor
+	setHudQuad(graphQuad + 1 + graphColumn, 0, 0, 0, 0, 0, goodColor);
+}
+
+// Per frame HUD values, each setter returns early when nothing changed
+void updateHud(double frameTime, double now)
+{
+	static double nextFpsUpdate = 0.0;
+	static unsigned int lastScore = 0xffffffff;
+	setHealthBar(game.playerStatus[localPlayer] == PLAYER_ALIVE ? game.playerHealth[localPlayer] : 0.0);
+
+	char text[HUD_MAX_TEXT];
+	if (game.score != lastScore) {
+		lastScore = game.score;
+		snprintf(text, sizeof(text), "SCORE %u", game.score);
+		setHudText(&scoreText, text);
+	}
+
+	// Readable numbers need a slower update than every frame
+	if (now >= nextFpsUpdate && smoothedFrameTime > 0.0) {
+		snprintf(text, sizeof(text), "%.0f FPS  %.1f MS", 1.0/smoothedFrameTime, smoothedFrameTime*1000.0);
+		setHudText(&fpsText, text);
+		nextFpsUpdate = now + FPS_UPDATE_INTERVAL;
+	}
+
+	double budget = 1.0/((pacingMode == PACING_CAPPED) ? frameRateCap : refreshRate);
+	addGraphSample(frameTime, budget);
+}
+
+// Upload whatever changed this frame and draw the whole HUD in one call
+void renderHud()
+{
+	glUseProgram(hudShader);
+	glBindVertexArray(hudVAO);
+	glBindBuffer(GL_ARRAY_BUFFER, hudVBO);
+	for (int i = 0; i < numDirtyRanges; i++) {
+		unsigned int first = dirtyFirstQuads[i];
+		glBufferSubData(GL_ARRAY_BUFFER, first*6*sizeof(struct HudVertex), (dirtyEndQuads[i] - first)*6*sizeof(struct HudVertex), &hudVertices[first*6]);
+	}
+	numDirtyRanges = 0;
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, hudAtlas);
+	glDrawArrays(GL_TRIANGLES, 0, numHudQuads*6);
+	glBindVertexArray(sceneVAO);
+	glUseProgram(sceneShader);
+}
+
+int render()
+{
+	int sceneWidth = screenWidth*resolutionScale;
+	int sceneHeight = screenHeight*resolutionScale;
+	if (isDynamicResolution) {
+		glBeginQuery(GL_TIME_ELAPSED, timerQueries[numTimerQueries % NUM_TIMER_QUERIES]);
+		timerQueryScales[numTimerQueries % NUM_TIMER_QUERIES] = resolutionScale;
+		glBindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
+		glViewport(0, 0, sceneWidth, sceneHeight);
+		glScissor(0, 0, sceneWidth, sceneHeight);
+		glEnable(GL_SCISSOR_TEST);
+		glLineWidth(LINE_WIDTH*resolutionScale);
+	}
 
-float playerX = 0.0;
-float playerY = 0.0;
-double playerAngle = 0.0;
-float playerVelocityX = 0.0;
-float playerVelocityY = 0.0;
-float playerHealth = 1.0;
+	/* Set background to black */
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	/* Render objects */
+	glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+	for (int i = 0; i < numObjects; i++) {
+		GLsizei numInstances = objects[i]->numInstances;
+		GLenum drawMode = objects[i]->drawMode;
+		GLsizei numIndices = objects[i]->indicesSize/sizeof(unsigned int);
+		void* objectIBOindex = (void*)(long)(objects[i]->IBOindex);
+		if (objects[i]->instances == NULL) {
+			glDrawElements(drawMode, numIndices, GL_UNSIGNED_INT, objectIBOindex);
+		} else {
+			long objectInstanceVBOindex = objects[i]->instanceVBOindex;
+			glVertexAttribPointer(1, 2, GL_SHORT, GL_TRUE, sizeof(struct PackedInstance), (void*)objectInstanceVBOindex);
+			glVertexAttribPointer(3, 1, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(struct PackedInstance), (void*)(objectInstanceVBOindex + offsetof(struct PackedInstance, angle)));
+			glDrawElementsInstanced(drawMode, numIndices, GL_UNSIGNED_INT, objectIBOindex, numInstances);
+		}
+	}
+
+	/* Scale up to the window */
+	if (isDynamicResolution) {
+		glDisable(GL_SCISSOR_TEST);
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, sceneFBO);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+		glBlitFramebuffer(0, 0, sceneWidth, sceneHeight, 0, 0, screenWidth, screenHeight, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glViewport(0, 0, screenWidth, screenHeight);
+		glEndQuery(GL_TIME_ELAPSED);
+		numTimerQueries++;
+		if (readGPUFrameTime()) updateResolutionScale();
+	}
+
+	/* HUD goes on top at full resolution */
+	renderHud();
+
+	/* Wait until it's time then swap buffers */
+	presentFrame();
+	return 0;
+}
+
+static unsigned int compileShader(unsigned int type, const char* source)
+{
+	unsigned int id = glCreateShader(type);
+	glShaderSource(id, 1, &source, nullptr);
+	glCompileShader(id);
+
+	// Error Checking
+	int result;
+	glGetShaderiv(id, GL_COMPILE_STATUS, &result);
+	if (result == GL_FALSE) {
+		int length;
+		glGetShaderiv(id, GL_INFO_LOG_LENGTH, &length);
+		char* message = (char*)alloca(length*sizeof(char));
+		glGetShaderInfoLog(id, length, &length, message);
+		printf("Failed to compile shader\n");
+		printf("%s\n", message);
+		glDeleteShader(id);
+		return 0;
+	}
+
+	return id;
+}
+
+static unsigned int createShader(const char* vertexShader, const char* fragmentShader)
+{
+	unsigned int program = glCreateProgram();
+	unsigned int vs = compileShader(GL_VERTEX_SHADER, vertexShader);
+	unsigned int fs = compileShader(GL_FRAGMENT_SHADER, fragmentShader);
+	glAttachShader(program, vs);
+	glAttachShader(program, fs);
+	glLinkProgram(program);
+	glValidateProgram(program);
+	glDeleteShader(vs);
+	glDeleteShader(fs);
+
+	return program;
+}
+
+static unsigned int createShaderFromFiles(char* vertexFileName, char* fragmentFileName)
+{
+	FILE *vertexFile = fopen(vertexFileName, "r");
+	if (vertexFile == NULL) {
+		printf("Could not read vertex shader file: %s\n", vertexFileName);
+		glfwTerminate();
+		exit(-1);
+	}
+	char* vertexShader = NULL;
+	size_t vertexShaderLen;
+	ssize_t vertexBytesRead = getdelim(&vertexShader, &vertexShaderLen, '\0', vertexFile);
+	if (vertexBytesRead == -1) {
+		printf("Error reading vertex shader file: %s\n", vertexFileName);
+		glfwTerminate();
+		exit(-1);
+	}
+
+	FILE *fragmentFile = fopen(fragmentFileName, "r");
+	if (fragmentFile == NULL) {
+		printf("Could not read fragment shader file: %s\n", fragmentFileName);
+		glfwTerminate();
+		exit(-1);
+	}
+	char* fragmentShader = NULL;
+	size_t fragmentShaderLen;
+	ssize_t fragmentBytesRead = getdelim(&fragmentShader, &fragmentShaderLen, '\0', fragmentFile);
+	if (fragmentBytesRead == -1) {
+		printf("Error reading fragment shader file: %s\n", fragmentFileName);
+		glfwTerminate();
+		exit(-1);
+	}
+
+	unsigned int shader = createShader(vertexShader, fragmentShader);
+	free(vertexShader);
+	free(fragmentShader);
+	return shader;
+}
+
+int isKeyDown(int key)
+{
+	return glfwGetKey(window, key) == GLFW_PRESS;
+}
+
+void handleKeyboardInput(unsigned int shader)
+{
+	glfwPollEvents();
+
+	/* Escape to Quit Game */
+	if (isKeyDown(GLFW_KEY_ESCAPE)) {
+		glDeleteProgram(shader);
+		glfwTerminate();
+		exit(0);
+	}
+
+	/* Hold backspace to rewind */
+	isRewinding = isKeyDown(GLFW_KEY_BACKSPACE);
+
+	/* R restarts after the game ends */
+	static int wasRetryKeyDown = 0;
+	int isRetryKeyDown = isKeyDown(GLFW_KEY_R);
+	isRetrying = isRetryKeyDown && !wasRetryKeyDown;
+	wasRetryKeyDown = isRetryKeyDown;
+
+	/* P cycles through frame pacing modes */
+	static int wasPacingKeyDown = 0;
+	int isPacingKeyDown = isKeyDown(GLFW_KEY_P);
+	if (isPacingKeyDown && !wasPacingKeyDown) {
+		setPacingMode((pacingMode + 1) % NUM_PACING_MODES);
+		printf("Frame pacing: %s\n", pacingModeNames[pacingMode]);
+	}
+	wasPacingKeyDown = isPacingKeyDown;
+
+	localInput = 0;
+	if (isKeyDown(GLFW_KEY_SPACE)) localInput |= INPUT_SHOOT;
+	if (isKeyDown(GLFW_KEY_LEFT)) localInput |= INPUT_TURN_LEFT;
+	if (isKeyDown(GLFW_KEY_RIGHT)) localInput |= INPUT_TURN_RIGHT;
+	if (isKeyDown(GLFW_KEY_LEFT_SHIFT)) localInput |= INPUT_SLOW_TURN;
+	if (isKeyDown(GLFW_KEY_W)) localInput |= INPUT_FORWARD;
+	if (isKeyDown(GLFW_KEY_A)) localInput |= INPUT_LEFT;
+	if (isKeyDown(GLFW_KEY_S)) localInput |= INPUT_BACK;
+	if (isKeyDown(GLFW_KEY_D)) localInput |= INPUT_RIGHT;
+}
+
+// Player movement and rotation, shared by the simulation and client side prediction
+void applyInput(unsigned int player, unsigned char input, double deltaT)
+{
+	float playerSpeed = 1.2;
+	float *location = &game.playerLocations[player*3];
+	float *velocity = &game.playerVelocities[player*2];
+	float playerAngle = location[2];
+
+	int wPressed = (input & INPUT_FORWARD) != 0;
+	int aPressed = (input & INPUT_LEFT) != 0;
+	int sPressed = (input & INPUT_BACK) != 0;
+	int dPressed = (input & INPUT_RIGHT) != 0;
+
+	// Detect if moving on X and Y axis at the same time
+	float speedMultiplier = 1.0;
+	velocity[0] = 0.0;
+	velocity[1] = 0.0;
+	if (wPressed != sPressed && aPressed != dPressed) {
+		speedMultiplier = sqrt(2.0)/2.0;
+	}
+	if (wPressed) {
+		velocity[1] += speedMultiplier*playerSpeed*cos(playerAngle);
+		velocity[0] += speedMultiplier*playerSpeed*sin(playerAngle);
+	}
+	if (aPressed) {
+		velocity[1] += speedMultiplier*playerSpeed*sin(playerAngle);
+		velocity[0] -= speedMultiplier*playerSpeed*cos(playerAngle);
+	}
+	if (sPressed) {
+		velocity[1] -= speedMultiplier*playerSpeed*cos(playerAngle);
+		velocity[0] -= speedMultiplier*playerSpeed*sin(playerAngle);
+	}
+	if (dPressed) {
+		velocity[1] -= speedMultiplier*playerSpeed*sin(playerAngle);
+		velocity[0] += speedMultiplier*playerSpeed*cos(playerAngle);
+	}
+	location[0] += velocity[0]*deltaT;
+	location[1] += velocity[1]*deltaT;
+
+	/* Player Rotation */
+	double playerRotationRate = 0.0;
+	if (input & INPUT_TURN_LEFT) {
+		playerRotationRate += -5.0;
+	}
+	if (input & INPUT_TURN_RIGHT) {
+		playerRotationRate += 5.0;
+	}
+	if (input & INPUT_SLOW_TURN) {
+		playerRotationRate *= 0.5;
+	}
+	location[2] += playerRotationRate*deltaT;
+	if (location[2] >= 2*PI) {
+		location[2] -= 2*PI;
+	};
+}
+
+int createCircle(float *circleVertices, unsigned int *circleIndices, int numSides)
+{
+	for (int i = 0; i < numSides; i++) {
+		double angle = (float)i/numSides*2*PI;
+		circleVertices[i*2] = cos(angle);
+		circleVertices[i*2 + 1] = sin(angle);
+		circleIndices[i] = i;
+	}
+	return 0;
+}
+
+// On screen for any living player
+int isOnScreen(float x, float y)
+{
+	for (int player = 0; player < MAX_PLAYERS; player++) {
+		if (game.playerStatus[player] != PLAYER_ALIVE) continue;
+		float deltaX = x - game.playerLocations[player*3];
+		float deltaY = y - game.playerLocations[player*3 + 1];
+		if (deltaX >= -aspectRatio*1.0 && deltaX <= aspectRatio*1.0 && deltaY >= -1.0 && deltaY <= 1.0) return 1;
+	}
+	return 0;
+}
+
+// Closest living player, or -1 if everyone is dead
+int nearestPlayer(float x, float y)
+{
+	int nearest = -1;
+	float nearestDistance = 0.0;
+	for (int player = 0; player < MAX_PLAYERS; player++) {
+		if (game.playerStatus[player] != PLAYER_ALIVE) continue;
+		float deltaX = x - game.playerLocations[player*3];
+		float deltaY = y - game.playerLocations[player*3 + 1];
+		float distance = deltaX*deltaX + deltaY*deltaY;
+		if (nearest == -1 || distance < nearestDistance) {
+			nearest = player;
+			nearestDistance = distance;
+		}
+	}
+	return nearest;
+}
+
+int spawnBullet(float *bulletLocations, float *bulletVelocities, int numBullets, float x, float y, float angle, float velocity)
+{
+	for (int i = 0; i < numBullets; i++) {
+		if (isOnScreen(bulletLocations[i*3], bulletLocations[i*3 + 1])) continue;
+		bulletLocations[i*3] = x;
+		bulletLocations[i*3 + 1] = y;
+		bulletLocations[i*3 + 2] = angle;
+		bulletVelocities[i*2] = velocity*sin(angle);
+		bulletVelocities[i*2 + 1] = velocity*cos(angle);
+		break;
+	}
+	return 0;
+}
+
+GLhalf floatToHalf(float value)
+{
+	union { float f; unsigned int u; } bits = { .f = value };
+	unsigned int sign = (bits.u >> 16) & 0x8000;
+	int exponent = (int)((bits.u >> 23) & 0xff) - 127 + 15;
+	unsigned int mantissa = bits.u & 0x7fffff;
+	if (exponent <= 0) {
+		// Denormal half (or zero if too small)
+		if (exponent < -10) return sign;
+		mantissa |= 0x800000;
+		return sign | (mantissa >> (14 - exponent));
+	}
+	if (exponent >= 31) return sign | 0x7c00; // Infinity
+	// Round to nearest, a carry out of the mantissa correctly bumps the exponent
+	return sign | (((exponent << 10) | (mantissa >> 13)) + ((mantissa >> 12) & 1));
+}
+
+short packCoordinate(float value)
+{
+	float scaled = value/ARENA_EXTENT;
+	if (scaled > 1.0) scaled = 1.0;
+	if (scaled < -1.0) scaled = -1.0;
+	return (short)lrintf(scaled*32767.0);
+}
+
+unsigned short packAngle(float angle)
+{
+	float turns = angle/(2*PI);
+	turns -= floorf(turns);
+	return (unsigned short)((unsigned int)lrintf(turns*65536.0) & 0xffff);
+}
+
+unsigned int packedVerticesSize(struct Object *object)
+{
+	return object->verticesSize/(2*sizeof(float))*sizeof(struct PackedVertex);
+}
+
+unsigned int packedInstancesSize(struct Object *object)
+{
+	return object->instancesSize/(3*sizeof(float))*sizeof(struct PackedInstance);
+}
+
+// Convert an object's float x, y, angle instances to the GPU format in instanceStaging
+// Returns how many instances were packed, just the ones being drawn
+unsigned int packInstances(struct Object *object)
+{
+	unsigned int numPacked = object->instancesSize/(3*sizeof(float));
+	if (object->numInstances < numPacked) numPacked = object->numInstances;
+	for (int i = 0; i < numPacked; i++) {
+		instanceStaging[i].x = packCoordinate(object->instances[i*3]);
+		instanceStaging[i].y = packCoordinate(object->instances[i*3 + 1]);
+		instanceStaging[i].angle = packAngle(object->instances[i*3 + 2]);
+	}
+	return numPacked;
+}
+int compareHits(const void *a, const void *b)
+{
+	float timeA = ((const struct Hit*)a)->time;
+	float timeB = ((const struct Hit*)b)->time;
+	return (timeA > timeB) - (timeA < timeB);
+}
+
+// Batched swept circle narrowphase. Projectiles and targets both moved in a straight
+// line over the last deltaT and are now at their locations (x, y, angle), velocities
+// are x, y in units per second. Anything at y = 1024 is dead and skipped.
+// Fills hits with every pair that came within radius, sorted by time of impact.
+unsigned int sweepCollisions(float *projectiles, float *projectileVelocities, unsigned int numProjectiles, float *targets, float *targetVelocities, unsigned int numTargets, float radius, double deltaT, struct Hit *hits, unsigned int maxHits)
+{
+	unsigned int numHits = 0;
+	float radiusSquared = radius*radius;
+	for (unsigned int target = 0; target < numTargets; target++) {
+		if (targets[target*3 + 1] == 1024) continue;
+		float targetMotionX = targetVelocities[target*2]*deltaT;
+		float targetMotionY = targetVelocities[target*2 + 1]*deltaT;
+		float targetStartX = targets[target*3] - targetMotionX;
+		float targetStartY = targets[target*3 + 1] - targetMotionY;
+
+		for (unsigned int projectile = 0; projectile < numProjectiles; projectile++) {
+			if (projectiles[projectile*3 + 1] == 1024) continue;
+			// Work relative to the target so that it sits still at the origin
+			float projectileMotionX = projectileVelocities[projectile*2]*deltaT;
+			float projectileMotionY = projectileVelocities[projectile*2 + 1]*deltaT;
+			float startX = projectiles[projectile*3] - projectileMotionX - targetStartX;
+			float startY = projectiles[projectile*3 + 1] - projectileMotionY - targetStartY;
+			float motionX = projectileMotionX - targetMotionX;
+			float motionY = projectileMotionY - targetMotionY;
+
+			// First t in [0, 1] where |start + t*motion| = radius
+			float time = 0.0;
+			float c = startX*startX + startY*startY - radiusSquared;
+			if (c > 0.0) {
+				float a = motionX*motionX + motionY*motionY;
+				float b = startX*motionX + startY*motionY;
+				if (b >= 0.0) continue; // Not getting closer
+				float discriminant = b*b - a*c;
+				if (discriminant < 0.0) continue; // Passes by
+				time = (-b - sqrtf(discriminant))/a;
+				if (time > 1.0) continue; // Not this tick
+			}
+
+			if (numHits == maxHits) break;
+			hits[numHits].time = time;
+			hits[numHits].projectile = projectile;
+			hits[numHits].target = target;
+			numHits++;
+		}
+	}
+	qsort(hits, numHits, sizeof(struct Hit), compareHits);
+	return numHits;
+}
+
+/* Bullet Patterns */
+
+// Each pattern is a list of steps run in order and then looped. A step fires
+// its shape repeat times, interval seconds apart, turning by spin each time.
+// A step with no bullets is just a pause.
+const struct PatternStep patterns[NUM_PATTERNS][MAX_PATTERN_STEPS] = {
+	[PATTERN_AIMED] = {
+		{.shape = SHAPE_SPREAD, .count = 1, .repeat = 1, .isAimed = 1, .speed = 1.0, .interval = 1.0/ENEMY_SHOOT_RATE},
+	},
+	[PATTERN_BURST] = {
+		{.shape = SHAPE_SPREAD, .count = 1, .repeat = 3, .isAimed = 1, .speed = 1.4, .interval = 0.08},
+		{.repeat = 1, .interval = 1.2},
+	},
+	[PATTERN_SPREAD] = {
+		{.shape = SHAPE_SPREAD, .count = 5, .repeat = 1, .isAimed = 1, .arc = 0.6, .speed = 1.0, .interval = 1.5},
+	},
+	[PATTERN_RING] = {
+		{.shape = SHAPE_RING, .count = 16, .repeat = 1, .speed = 0.7, .interval = 2.0},
+	},
+	[PATTERN_SPIRAL] = {
+		{.shape = SHAPE_RING, .count = 4, .repeat = 30, .speed = 0.8, .spin = 0.2, .interval = 0.06},
+		{.repeat = 1, .interval = 1.5},
+	},
+};
+
+// Fire one volley as a single batch on the end of the enemy bullet pool
+void emitPattern(float x, float y, float angle, const struct PatternStep *step)
+{
+	static _Alignas(16) float directionX[MAX_PATTERN_BULLETS + 4];
+	static _Alignas(16) float directionY[MAX_PATTERN_BULLETS + 4];
+	unsigned int first = game.numEnemyBullets;
+	unsigned int count = step->count;
+	if (count > MAX_ENEMY_BULLETS - first) count = MAX_ENEMY_BULLETS - first;
+	if (count == 0) return;
+
+	// Evenly spaced, a ring doesn't double up its first bullet
+	float spacing;
+	if (step->shape == SHAPE_RING) {
+		spacing = 2*PI/step->count;
+	} else {
+		spacing = (step->count > 1) ? step->arc/(step->count - 1) : 0.0;
+		angle -= 0.5*step->arc;
+	}
+
+	// Only the first four directions need sin and cos, the rest are those rotated by four spacings
+	for (int i = 0; i < 4; i++) {
+		directionX[i] = sin(angle + i*spacing);
+		directionY[i] = cos(angle + i*spacing);
+	}
+	float rotationSin = sin(4*spacing);
+	float rotationCos = cos(4*spacing);
+#ifdef __SSE2__
+	__m128 rotateSin = _mm_set1_ps(rotationSin);
+	__m128 rotateCos = _mm_set1_ps(rotationCos);
+	for (int i = 4; i < count; i += 4) {
+		__m128 previousX = _mm_load_ps(&directionX[i - 4]);
+		__m128 previousY = _mm_load_ps(&directionY[i - 4]);
+		_mm_store_ps(&directionX[i], _mm_add_ps(_mm_mul_ps(previousX, rotateCos), _mm_mul_ps(previousY, rotateSin)));
+		_mm_store_ps(&directionY[i], _mm_sub_ps(_mm_mul_ps(previousY, rotateCos), _mm_mul_ps(previousX, rotateSin)));
+	}
+#else
+	for (int i = 4; i < count; i++) {
+		directionX[i] = directionX[i - 4]*rotationCos + directionY[i - 4]*rotationSin;
+		directionY[i] = directionY[i - 4]*rotationCos - directionX[i - 4]*rotationSin;
+	}
+#endif
+
+	unsigned int *ids = &game.enemyBulletIds[first];
+	float *locations = &game.enemyBulletLocations[first*3];
+	float *velocities = &game.enemyBulletVelocities[first*2];
+	for (int i = 0; i < count; i++) {
+		ids[i] = game.nextEnemyBulletId++;
+		locations[i*3] = x;
+		locations[i*3 + 1] = y;
+		locations[i*3 + 2] = angle + i*spacing;
+		velocities[i*2] = directionX[i]*step->speed;
+		velocities[i*2 + 1] = directionY[i]*step->speed;
+	}
+	game.numEnemyBullets += count;
+}
+
+// Enemy bullets are packed with no dead ones in between, so they can be moved four at a time
+void moveEnemyBullets(double deltaT)
+{
+	float *locations = game.enemyBulletLocations;
+	float *velocities = game.enemyBulletVelocities;
+	unsigned int i = 0;
+#ifdef __SSE2__
+	// Four bullets are three vectors of x y angle and two of vx vy, so spread the
+	// velocities out to line up and leave the angles alone
+	__m128 time = _mm_set1_ps(deltaT);
+	__m128 mask0 = _mm_castsi128_ps(_mm_set_epi32(-1, 0, -1, -1));
+	__m128 mask1 = _mm_castsi128_ps(_mm_set_epi32(-1, -1, 0, -1));
+	__m128 mask2 = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, 0));
+	for (; i + 4 <= game.numEnemyBullets; i += 4) {
+		float *location = &locations[i*3];
+		__m128 velocity0 = _mm_loadu_ps(&velocities[i*2]); // vx0 vy0 vx1 vy1
+		__m128 velocity1 = _mm_loadu_ps(&velocities[i*2 + 4]); // vx2 vy2 vx3 vy3
+		__m128 motion0 = _mm_and_ps(_mm_shuffle_ps(velocity0, velocity0, _MM_SHUFFLE(2, 0, 1, 0)), mask0); // vx0 vy0 0 vx1
+		__m128 motion1 = _mm_and_ps(_mm_shuffle_ps(velocity0, velocity1, _MM_SHUFFLE(1, 0, 3, 3)), mask1); // vy1 0 vx2 vy2
+		__m128 motion2 = _mm_and_ps(_mm_shuffle_ps(velocity1, velocity1, _MM_SHUFFLE(3, 3, 2, 2)), mask2); // 0 vx3 vy3 0
+		_mm_storeu_ps(&location[0], _mm_add_ps(_mm_loadu_ps(&location[0]), _mm_mul_ps(motion0, time)));
+		_mm_storeu_ps(&location[4], _mm_add_ps(_mm_loadu_ps(&location[4]), _mm_mul_ps(motion1, time)));
+		_mm_storeu_ps(&location[8], _mm_add_ps(_mm_loadu_ps(&location[8]), _mm_mul_ps(motion2, time)));
+	}
+#endif
+	for (; i < game.numEnemyBullets; i++) {
+		locations[i*3] += velocities[i*2]*deltaT;
+		locations[i*3 + 1] += velocities[i*2 + 1]*deltaT;
+	}
+}
+
+// Slides the live bullets down over the dead ones rather than swapping the last one
+// in, so they stay sorted by id for writeSnapshot()
+void removeDeadEnemyBullets()
+{
+	unsigned int live = 0;
+	for (unsigned int bullet = 0; bullet < game.numEnemyBullets; bullet++) {
+		if (game.enemyBulletLocations[bullet*3 + 1] == 1024) continue;
+		if (live != bullet) {
+			game.enemyBulletIds[live] = game.enemyBulletIds[bullet];
+			memcpy(&game.enemyBulletLocations[live*3], &game.enemyBulletLocations[bullet*3], 3*sizeof(float));
+			memcpy(&game.enemyBulletVelocities[live*2], &game.enemyBulletVelocities[bullet*2], 2*sizeof(float));
+		}
+		live++;
+	}
+	game.numEnemyBullets = live;
+}
+
+/* Timers */
+
+// Hierarchical timer wheel: each level has TIMER_SLOTS slots and each slot of a level
+// covers a whole turn of the level below it. A timer goes into the lowest level that can
+// hold it and moves down a level when that level comes round to its slot, so scheduling,
+// cancelling and firing are all O(1) and a tick where nothing is due just checks one slot.
+// Everything is an index into game.timers so that it snapshots with the rest of the game.
+
+void initTimers()
+{
+	game.timerTick = 0;
+	game.timerRemainder = 0.0;
+	for (int level = 0; level < TIMER_LEVELS; level++) {
+		for (int slot = 0; slot < TIMER_SLOTS; slot++) game.timerSlots[level][slot] = -1;
+	}
+	for (int i = 0; i < MAX_TIMERS; i++) game.timers[i].next = i + 1;
+	game.timers[MAX_TIMERS - 1].next = -1;
+	game.freeTimer = 0;
+}
+
+void insertTimer(int index)
+{
+	struct Timer *timer = &game.timers[index];
+	unsigned int delta = timer->expires - game.timerTick;
+	int level = 0;
+	while (level < TIMER_LEVELS - 1 && delta >= 1u << (TIMER_SLOT_BITS*(level + 1))) level++;
+	int slot = (timer->expires >> (TIMER_SLOT_BITS*level)) & (TIMER_SLOTS - 1);
+	int *head = &game.timerSlots[level][slot];
+	timer->slot = level*TIMER_SLOTS + slot;
+	timer->prev = -1;
+	timer->next = *head;
+	if (*head != -1) game.timers[*head].prev = index;
+	*head = index;
+}
+
+void unlinkTimer(int index)
+{
+	struct Timer *timer = &game.timers[index];
+	if (timer->prev == -1) {
+		game.timerSlots[timer->slot / TIMER_SLOTS][timer->slot % TIMER_SLOTS] = timer->next;
+	} else {
+		game.timers[timer->prev].next = timer->next;
+	}
+	if (timer->next != -1) game.timers[timer->next].prev = timer->prev;
+}
+
+// Call fireTimer(type, entity) after delay seconds, returns the timer (for cancelTimer) or -1 if there are none left
+int scheduleTimer(unsigned int type, unsigned int entity, double delay)
+{
+	int index = game.freeTimer;
+	if (index == -1) {
+		printf("Out of timers (%d)\n", MAX_TIMERS);
+		return -1;
+	}
+	game.freeTimer = game.timers[index].next;
+
+	long ticks = lrint(delay*TIMER_RATE);
+	if (ticks < 1) ticks = 1;
+	if (ticks > TIMER_MAX_TICKS) ticks = TIMER_MAX_TICKS;
+	struct Timer *timer = &game.timers[index];
+	timer->expires = game.timerTick + ticks;
+	timer->type = type;
+	timer->entity = entity;
+	insertTimer(index);
+	return index;
+}
+
+void freeTimer(int index)
+{
+	game.timers[index].type = TIMER_NONE;
+	game.timers[index].next = game.freeTimer;
+	game.freeTimer = index;
+}
+
+void cancelTimer(int index)
+{
+	if (index == -1 || game.timers[index].type == TIMER_NONE) return;
+	unlinkTimer(index);
+	freeTimer(index);
+}
+
+// Append up to count enemies to the pool in a ring around (x, y) all shooting pattern, returns how many fit
+unsigned int spawnEnemies(float x, float y, float radius, unsigned int count, unsigned int pattern)
+{
+	unsigned int first = game.numEnemies;
+	if (count > MAX_ENEMIES - first) count = MAX_ENEMIES - first;
+	for (int i = 0; i < count; i++) {
+		unsigned int enemy = first + i;
+		float angle = 2*PI*i/count;
+		game.enemyLocations[enemy*3] = x + sin(angle)*radius;
+		game.enemyLocations[enemy*3 + 1] = y + cos(angle)*radius;
+		game.enemyLocations[enemy*3 + 2] = angle;
+		game.enemyVelocities[enemy*2] = 0.0;
+		game.enemyVelocities[enemy*2 + 1] = 0.0;
+		game.enemyHealth[enemy] = 1.0;
+		game.enemyPattern[enemy] = pattern;
+		game.enemyPatternStep[enemy] = 0;
+		game.enemyPatternRepeat[enemy] = 0;
+		// Spread the first shots out so a wave doesn't fire all at once
+		game.enemyShootTimer[enemy] = scheduleTimer(TIMER_ENEMY_SHOOT, enemy, (1.0 + (float)i/count)/ENEMY_SHOOT_RATE);
+	}
+	game.numEnemies += count;
+	return count;
+}
+
+// Fill the holes dead enemies left by moving the last live enemy into each one
+void removeDeadEnemies()
+{
+	unsigned int enemy = 0;
+	while (enemy < game.numEnemies) {
+		if (game.enemyLocations[enemy*3 + 1] != 1024) {
+			enemy++;
+			continue;
+		}
+		cancelTimer(game.enemyShootTimer[enemy]);
+		unsigned int last = --game.numEnemies;
+		if (enemy != last) {
+			memcpy(&game.enemyLocations[enemy*3], &game.enemyLocations[last*3], 3*sizeof(float));
+			memcpy(&game.enemyVelocities[enemy*2], &game.enemyVelocities[last*2], 2*sizeof(float));
+			game.enemyHealth[enemy] = game.enemyHealth[last];
+			game.enemyShootTimer[enemy] = game.enemyShootTimer[last];
+			game.enemyPattern[enemy] = game.enemyPattern[last];
+			game.enemyPatternStep[enemy] = game.enemyPatternStep[last];
+			game.enemyPatternRepeat[enemy] = game.enemyPatternRepeat[last];
+			if (game.enemyShootTimer[enemy] != -1) game.timers[game.enemyShootTimer[enemy]].entity = enemy;
+		}
+		game.enemyLocations[last*3 + 1] = 1024;
+		game.enemyHealth[last] = 0.0;
+		game.enemyShootTimer[last] = -1;
+	}
+}
+
+int isPlayerNear(float x, float y, float range)
+{
+	int nearest = nearestPlayer(x, y);
+	if (nearest == -1) return 0;
+	float deltaX = x - game.playerLocations[nearest*3];
+	float deltaY = y - game.playerLocations[nearest*3 + 1];
+	return deltaX*deltaX + deltaY*deltaY <= range*range;
+}
+
+void fireTimer(unsigned int type, unsigned int entity)
+{
+	if (type == TIMER_PLAYER_RELOAD) {
+		// Keep shooting at exactly the fire rate while the button is held
+		game.playerReloadTimer[entity] = -1;
+		if (game.playerStatus[entity] == PLAYER_ALIVE && (playerInputs[entity] & INPUT_SHOOT)) {
+			float *location = &game.playerLocations[entity*3];
+			spawnBullet(game.playerBulletLocations, game.playerBulletVelocities, NUM_PLAYER_BULLETS, location[0], location[1], location[2], 4.0);
+			playSoundAt(SOUND_PLAYER_SHOOT, location[0], (entity == localPlayer) ? 1.0 : 0.5);
+			game.playerReloadTimer[entity] = scheduleTimer(TIMER_PLAYER_RELOAD, entity, 1.0/PLAYER_SHOOT_RATE);
+		} else {
+			game.isPlayerGunReady[entity] = 1;
+		}
+	} else if (type == TIMER_ENEMY_SHOOT) {
+		float *location = &game.enemyLocations[entity*3];
+		game.enemyShootTimer[entity] = -1;
+		if (location[1] == 1024) return; // Dead, so the timer just stops
+
+		// Fire the next volley of the enemy's pattern, then wait for the one after
+		const struct PatternStep *pattern = patterns[game.enemyPattern[entity]];
+		const struct PatternStep *step = &pattern[game.enemyPatternStep[entity]];
+		unsigned char *repeat = &game.enemyPatternRepeat[entity];
+		if (step->count > 0 && isOnScreen(location[0], location[1])) {
+			float angle = (step->isAimed ? location[2] : 0.0) + *repeat*step->spin;
+			emitPattern(location[0], location[1], angle, step);
+			if (*repeat == 0) playSoundAt(SOUND_ENEMY_SHOOT, location[0], 0.6);
+		}
+		float delay = step->interval;
+		if (++*repeat >= step->repeat) {
+			*repeat = 0;
+			game.enemyPatternStep[entity]++;
+			if (game.enemyPatternStep[entity] == MAX_PATTERN_STEPS || step[1].repeat == 0) game.enemyPatternStep[entity] = 0;
+		}
+		game.enemyShootTimer[entity] = scheduleTimer(TIMER_ENEMY_SHOOT, entity, delay);
+	} else if (type == TIMER_WORMHOLE_WAVE) {
+		float *location = &game.wormholeInfo[entity*3];
+		if (location[1] == 1024) return; // Destroyed
+		// Each wave is bigger than the last, and all of it goes into the pool in one go
+		if (isPlayerNear(location[0], location[1], WORMHOLE_RANGE)) {
+			unsigned int size = WAVE_FIRST_SIZE + game.wormholeWave[entity];
+			if (size > WAVE_MAX_SIZE) size = WAVE_MAX_SIZE;
+			// Later waves bring nastier patterns, staying on the densest one from then on
+			unsigned int pattern = game.wormholeWave[entity];
+			if (pattern > NUM_PATTERNS - 1) pattern = NUM_PATTERNS - 1;
+			if (spawnEnemies(location[0], location[1], WAVE_RADIUS, size, pattern) > 0) {
+				game.wormholeWave[entity]++;
+			}
+		}
+		scheduleTimer(TIMER_WORMHOLE_WAVE, entity, WAVE_INTERVAL);
+	}
+}
+
+// Moves a higher level slot's timers down now that the levels below have come round to it
+void cascadeTimers(int level, int slot)
+{
+	int index;
+	while ((index = game.timerSlots[level][slot]) != -1) {
+		unlinkTimer(index);
+		insertTimer(index);
+	}
+}
+
+// Fire everything that comes due in the next deltaT seconds
+void runTimers(double deltaT)
+{
+	game.timerRemainder += deltaT*TIMER_RATE;
+	while (game.timerRemainder >= 1.0) {
+		game.timerRemainder -= 1.0;
+		unsigned int tick = ++game.timerTick;
+
+		for (int level = 1; level < TIMER_LEVELS; level++) {
+			if ((tick >> (TIMER_SLOT_BITS*(level - 1))) & (TIMER_SLOTS - 1)) break;
+			cascadeTimers(level, (tick >> (TIMER_SLOT_BITS*level)) & (TIMER_SLOTS - 1));
+		}
+
+		// One at a time, firing can schedule or cancel other timers
+		int index;
+		while ((index = game.timerSlots[0][tick & (TIMER_SLOTS - 1)]) != -1) {
+			struct Timer timer = game.timers[index];
+			unlinkTimer(index);
+			freeTimer(index);
+			fireTimer(timer.type, timer.entity);
+		}
+	}
+}
+
+// Advance the simulation using playerInputs, returns 1 once every enemy is dead
+int updateGame(double deltaT)
+{
+	/* Player Movement */
+	for (int player = 0; player < MAX_PLAYERS; player++) {
+		if (game.playerStatus[player] != PLAYER_ALIVE) continue;
+		applyInput(player, playerInputs[player], deltaT);
+	}
+
+	/* Enemy Movement and Rotation */
+	for (int i = 0; i < game.numEnemies; i++) {
+		game.enemyVelocities[i*2] = 0.0;
+		game.enemyVelocities[i*2 + 1] = 0.0;
+		if (game.enemyLocations[i*3 + 1] == 1024) continue;
+		int target = nearestPlayer(game.enemyLocations[i*3], game.enemyLocations[i*3 + 1]);
+		if (target == -1) continue;
+		float enemySpeed = 0.5;
+		// Update Angle
+		float enemyAngle = game.enemyLocations[i*3 + 2];
+		float deltaX = game.playerLocations[target*3] - game.enemyLocations[i*3];
+		float deltaY = game.playerLocations[target*3 + 1] - game.enemyLocations[i*3 + 1];
+		enemyAngle = atan2(deltaX, deltaY);
+		game.enemyLocations[i*3 + 2] = enemyAngle;
+
+		// Update position if on screen
+		int enemyOnScreen = abs(deltaX) <= aspectRatio && abs(deltaY) <= 1.0;
+		if (enemyOnScreen) {
+			// Update Position
+			game.enemyVelocities[i*2] = sin(enemyAngle)*enemySpeed; // X
+			game.enemyVelocities[i*2 + 1] = cos(enemyAngle)*enemySpeed; // Y
+			game.enemyLocations[i*3] += game.enemyVelocities[i*2]*deltaT;
+			game.enemyLocations[i*3 + 1] += game.enemyVelocities[i*2 + 1]*deltaT;
+		}
+	}
+
+	/* Player Bullet Movement */
+
+	// Check if each bullet is out of bounds
+	for (int i = 0; i < NUM_PLAYER_BULLETS; i++) {
+		float bulletX = game.playerBulletLocations[i*3];
+		float bulletY = game.playerBulletLocations[i*3 + 1];
+		if (!isOnScreen(bulletX, bulletY)) {
+			game.playerBulletLocations[i*3 + 1] = 1024;
+		}
+	}
+
+	// Scheduled events, this is where reloads finish and enemies shoot
+	runTimers(deltaT);
+
+	// Add new bullet, held fire continues from the reload timer
+	for (int player = 0; player < MAX_PLAYERS; player++) {
+		if (game.playerStatus[player] != PLAYER_ALIVE) continue;
+		if ((playerInputs[player] & INPUT_SHOOT) && game.isPlayerGunReady[player]) {
+			game.isPlayerGunReady[player] = 0;
+			float *location = &game.playerLocations[player*3];
+			spawnBullet(game.playerBulletLocations, game.playerBulletVelocities, NUM_PLAYER_BULLETS, location[0], location[1], location[2], 4.0);
+			playSoundAt(SOUND_PLAYER_SHOOT, location[0], (player == localPlayer) ? 1.0 : 0.5);
+			game.playerReloadTimer[player] = scheduleTimer(TIMER_PLAYER_RELOAD, player, 1.0/PLAYER_SHOOT_RATE);
+		}
+	}
+
+	// Move Bullets
+	for (int i = 0; i < NUM_PLAYER_BULLETS; i++) {
+		if (game.playerBulletLocations[i*3 + 1] == 1024) continue;
+		game.playerBulletLocations[i*3] += game.playerBulletVelocities[i*2]*deltaT;
+		game.playerBulletLocations[i*3 + 1] += game.playerBulletVelocities[i*2 + 1]*deltaT;
+	}
+
+	/* Enemy Bullet Movement */
+
+	// Move Bullets, they were spawned by the timers above
+	moveEnemyBullets(deltaT);
+
+	// Check if each bullet is out of bounds, they get removed after collisions
+	for (int i = 0; i < game.numEnemyBullets; i++) {
+		float bulletX = game.enemyBulletLocations[i*3];
+		float bulletY = game.enemyBulletLocations[i*3 + 1];
+		if (!isOnScreen(bulletX, bulletY)) {
+			game.enemyBulletLocations[i*3 + 1] = 1024;
+		}
+	}
+
+	/* Collision Detection */
+
+	// Out of Bounds Detection
+	for (int player = 0; player < MAX_PLAYERS; player++) {
+		if (game.playerStatus[player] != PLAYER_ALIVE) continue;
+		float playerX = game.playerLocations[player*3];
+		float playerY = game.playerLocations[player*3 + 1];
+		if ((playerX*playerX + playerY*playerY) >= BOUNDARY_RADIUS*BOUNDARY_RADIUS) {
+			game.playerStatus[player] = PLAYER_OUT_OF_BOUNDS;
+		}
+	}
+
+	// Everything is swept over the tick so that fast bullets can't tunnel through
+	// on a slow frame, and hits are handled in the order they happened
+
+	// Enemy and Player
+	unsigned int numHits = sweepCollisions(game.enemyLocations, game.enemyVelocities, game.numEnemies, game.playerLocations, game.playerVelocities, MAX_PLAYERS, PLAYER_HITBOX_RAD + ENEMY_HITBOX_RAD, deltaT, hits, MAX_HITS);
+	for (int i = 0; i < numHits; i++) {
+		unsigned int enemy = hits[i].projectile;
+		unsigned int player = hits[i].target;
+		if (game.enemyLocations[enemy*3 + 1] == 1024 || game.playerStatus[player] != PLAYER_ALIVE) continue;
+		playSoundAt(SOUND_EXPLOSION, game.enemyLocations[enemy*3], 1.0);
+		playSoundAt(SOUND_PLAYER_HIT, game.playerLocations[player*3], 1.0);
+		game.enemyLocations[enemy*3 + 1] = 1024;
+		game.enemyHealth[enemy] = 0.0;
+		game.playerHealth[player] -= 0.5;
+	}
+
+	// Enemy and Player Bullet
+	numHits = sweepCollisions(game.playerBulletLocations, game.playerBulletVelocities, NUM_PLAYER_BULLETS, game.enemyLocations, game.enemyVelocities, game.numEnemies, ENEMY_HITBOX_RAD + PLAYER_BULLET_HITBOX_RAD, deltaT, hits, MAX_HITS);
+	for (int i = 0; i < numHits; i++) {
+		unsigned int bullet = hits[i].projectile;
+		unsigned int enemy = hits[i].target;
+		if (game.playerBulletLocations[bullet*3 + 1] == 1024 || game.enemyLocations[enemy*3 + 1] == 1024) continue;
+		game.enemyHealth[enemy] -= 0.1;
+		game.playerBulletLocations[bullet*3 + 1] = 1024;
+		game.score += 10;
+		if (game.enemyHealth[enemy] <= 0.0) {
+			playSoundAt(SOUND_EXPLOSION, game.enemyLocations[enemy*3], 1.0);
+			game.enemyLocations[enemy*3 + 1] = 1024;
+			game.score += 100;
+		} else {
+			playSoundAt(SOUND_HIT, game.enemyLocations[enemy*3], 0.8);
+		}
+	}
+
+	// Wormhole and Player Bullet
+	numHits = sweepCollisions(game.playerBulletLocations, game.playerBulletVelocities, NUM_PLAYER_BULLETS, game.wormholeInfo, wormholeVelocities, NUM_WORMHOLES, WORMHOLE_HITBOX_RAD + PLAYER_BULLET_HITBOX_RAD, deltaT, hits, MAX_HITS);
+	for (int i = 0; i < numHits; i++) {
+		unsigned int bullet = hits[i].projectile;
+		unsigned int wormhole = hits[i].target;
+		if (game.playerBulletLocations[bullet*3 + 1] == 1024 || game.wormholeInfo[wormhole*3 + 1] == 1024) continue;
+		game.wormholeHealth[wormhole] -= WORMHOLE_DAMAGE;
+		game.playerBulletLocations[bullet*3 + 1] = 1024;
+		game.score += 10;
+		if (game.wormholeHealth[wormhole] <= 0.0) {
+			playSoundAt(SOUND_EXPLOSION, game.wormholeInfo[wormhole*3], 1.0);
+			game.wormholeInfo[wormhole*3 + 1] = 1024;
+			game.score += 1000;
+		} else {
+			playSoundAt(SOUND_HIT, game.wormholeInfo[wormhole*3], 0.5);
+		}
+	}
+
+	// Player and Enemy Bullet
+	numHits = sweepCollisions(game.enemyBulletLocations, game.enemyBulletVelocities, game.numEnemyBullets, game.playerLocations, game.playerVelocities, MAX_PLAYERS, PLAYER_HITBOX_RAD + ENEMY_BULLET_RAD, deltaT, hits, MAX_HITS);
+	for (int i = 0; i < numHits; i++) {
+		unsigned int bullet = hits[i].projectile;
+		unsigned int player = hits[i].target;
+		if (game.enemyBulletLocations[bullet*3 + 1] == 1024 || game.playerStatus[player] != PLAYER_ALIVE) continue;
+		game.playerHealth[player] -= 0.25;
+		game.enemyBulletLocations[bullet*3 + 1] = 1024;
+		playSoundAt(SOUND_PLAYER_HIT, game.playerLocations[player*3], 1.0);
+	}
+
+	/* Win/Lose Game Detection */
+	for (int player = 0; player < MAX_PLAYERS; player++) {
+		if (game.playerStatus[player] == PLAYER_ALIVE && game.playerHealth[player] <= 0.0) {
+			game.playerStatus[player] = PLAYER_DEAD;
+		}
+	}
+	removeDeadEnemies();
+	removeDeadEnemyBullets();
+	int youWin = game.numEnemies == 0;
+	for (int wormhole = 0; wormhole < NUM_WORMHOLES; wormhole++) {
+		if (game.wormholeInfo[wormhole*3 + 1] != 1024) youWin = 0;
+	}
+	return youWin;
+}
+
+void initGame()
+{
+	float enemyStartLocations[3*NUM_START_ENEMIES] = {
+		-4.0, 0.0, 0.0,
+		0.0, -4.0, 0.0,
+		4.0, 0.0, 0.0,
+		1.0, 3.0, 0.0,
+		0.0, 4.0, 0.0,
+		-1.0, 3.0, 0.0,
+	};
+	float wormholeStartInfo[3*NUM_WORMHOLES] = {
+		-4.0, 0.2, 0.0,
+		4.0, -0.2, 0.0,
+		0.0, 4.3, 0.0,
+	};
+
+	memset(&game, 0, sizeof(game));
+	initTimers();
+	for (int i = 0; i < MAX_PLAYERS; i++) {
+		game.playerLocations[i*3 + 1] = 1024;
+		game.playerReloadTimer[i] = -1;
+	}
+	for (int i = 0; i < MAX_ENEMIES; i++) {
+		game.enemyLocations[i*3 + 1] = 1024;
+		game.enemyShootTimer[i] = -1;
+	}
+	for (int i = 0; i < NUM_START_ENEMIES; i++) {
+		spawnEnemies(enemyStartLocations[i*3], enemyStartLocations[i*3 + 1], 0.0, 1, PATTERN_AIMED);
+	}
+	memcpy(game.wormholeInfo, wormholeStartInfo, sizeof(wormholeStartInfo));
+	for (int i = 0; i < NUM_WORMHOLES; i++) {
+		game.wormholeHealth[i] = 1.0;
+		scheduleTimer(TIMER_WORMHOLE_WAVE, i, WAVE_INTERVAL);
+	}
+	for (int i = 0; i < NUM_PLAYER_BULLETS; i++) {
+		game.playerBulletLocations[i*3 + 1] = 1024;
+	}
+	numSnapshots = 0;
+}
+
+// Bring a player into the game, spread out around the center of the arena
+void spawnPlayer(unsigned int player)
+{
+	game.playerStatus[player] = PLAYER_ALIVE;
+	game.playerHealth[player] = 1.0;
+	cancelTimer(game.playerReloadTimer[player]);
+	game.playerReloadTimer[player] = -1;
+	game.isPlayerGunReady[player] = 1;
+	game.playerLocations[player*3] = 0.3*player;
+	game.playerLocations[player*3 + 1] = 0.0;
+	game.playerLocations[player*3 + 2] = 0.0;
+	game.playerVelocities[player*2] = 0.0;
+	game.playerVelocities[player*2 + 1] = 0.0;
+}
+
+// Simulation time per frame while enemies are spawned from the wormholes and killed at a fixed rate
+int runSpawnBenchmark()
+{
+	double spawnRates[] = {0.0, 1000.0, 5000.0, 20000.0, 50000.0}; // Enemies per second
+	double deltaT = 1.0/TICK_RATE;
+	aspectRatio = NET_ASPECT_RATIO;
+	for (int rate = 0; rate < sizeof(spawnRates)/sizeof(spawnRates[0]); rate++) {
+		initGame();
+		spawnPlayer(0);
+		// Sit next to a wormhole so its enemies are on screen and active
+		game.playerLocations[0] = game.wormholeInfo[0] + 0.5;
+		game.playerLocations[1] = game.wormholeInfo[1];
+
+		double spawnDebt = 0.0;
+		double totalTime = 0.0;
+		double maxTime = 0.0;
+		unsigned long totalEnemies = 0;
+		unsigned long totalRemoved = 0;
+		unsigned long totalSpawned = 0;
+		srand(1);
+		for (int frame = 0; frame < SPAWN_BENCH_FRAMES; frame++) {
+			game.playerStatus[0] = PLAYER_ALIVE;
+			game.playerHealth[0] = 1.0;
+			spawnDebt += spawnRates[rate]*deltaT;
+			unsigned int count = spawnDebt;
+			spawnDebt -= count;
+
+			double start = getTime();
+			// Kill enough to keep the pool half full, spread through it like collisions would.
+			// Each one is a different live enemy, the next one along if the random pick is dead
+			int numKilled = game.numEnemies + count - MAX_ENEMIES/2;
+			if (numKilled < 0) numKilled = 0;
+			if (numKilled > game.numEnemies) numKilled = game.numEnemies;
+			for (int i = 0; i < numKilled; i++) {
+				unsigned int enemy = rand() % game.numEnemies;
+				while (game.enemyLocations[enemy*3 + 1] == 1024) enemy = (enemy + 1) % game.numEnemies;
+				game.enemyLocations[enemy*3 + 1] = 1024;
+			}
+			for (int wormhole = 0; wormhole < NUM_WORMHOLES; wormhole++) {
+				unsigned int batch = count/NUM_WORMHOLES + (wormhole < count % NUM_WORMHOLES);
+				totalSpawned += spawnEnemies(game.wormholeInfo[wormhole*3], game.wormholeInfo[wormhole*3 + 1], WAVE_RADIUS, batch, wormhole % NUM_PATTERNS);
+			}
+			updateGame(deltaT);
+			double frameTime = getTime() - start;
+
+			totalTime += frameTime;
+			maxTime = (frameTime > maxTime) ? frameTime : maxTime;
+			totalEnemies += game.numEnemies;
+			totalRemoved += numKilled;
+		}
+		// The pool fills up at the highest rates, so print what actually got spawned
+		printf("%6.0f enemies/s (%.0f asked for): %.3f ms mean, %.3f ms max per frame, %lu live enemies on average, %.0f removed/s\n",
+			totalSpawned/(SPAWN_BENCH_FRAMES*deltaT), spawnRates[rate], totalTime/SPAWN_BENCH_FRAMES*1000.0, maxTime*1000.0, totalEnemies/SPAWN_BENCH_FRAMES,
+			totalRemoved/(SPAWN_BENCH_FRAMES*deltaT));
+	}
+	return 0;
+}
+
+// Like a memcpy, but skips the unused part of the enemy bullet pool so a
+// state with a few bullets in it costs a few bullets' worth to copy
+void copyGameState(struct GameState *destination, struct GameState *source)
+{
+	memcpy(destination, source, offsetof(struct GameState, enemyBulletIds));
+	memcpy(destination->enemyBulletIds, source->enemyBulletIds, source->numEnemyBullets*sizeof(unsigned int));
+	memcpy(destination->enemyBulletLocations, source->enemyBulletLocations, source->numEnemyBullets*3*sizeof(float));
+	memcpy(destination->enemyBulletVelocities, source->enemyBulletVelocities, source->numEnemyBullets*2*sizeof(float));
+}
+
+// Copy a state's enemy bullets into bulletHistory at position (or back out of it
+// if isLoad), wrapping round the end of the ring
+void copyBulletHistory(struct GameState *state, unsigned long position, unsigned int count, int isLoad)
+{
+	unsigned int *ids = state->enemyBulletIds;
+	float *locations = state->enemyBulletLocations;
+	float *velocities = state->enemyBulletVelocities;
+	while (count > 0) {
+		unsigned int index = position % BULLET_HISTORY;
+		unsigned int chunk = BULLET_HISTORY - index;
+		if (chunk > count) chunk = count;
+		if (isLoad) {
+			memcpy(ids, &bulletHistoryIds[index], chunk*sizeof(unsigned int));
+			memcpy(locations, &bulletHistoryLocations[index*3], chunk*3*sizeof(float));
+			memcpy(velocities, &bulletHistoryVelocities[index*2], chunk*2*sizeof(float));
+		} else {
+			memcpy(&bulletHistoryIds[index], ids, chunk*sizeof(unsigned int));
+			memcpy(&bulletHistoryLocations[index*3], locations, chunk*3*sizeof(float));
+			memcpy(&bulletHistoryVelocities[index*2], velocities, chunk*2*sizeof(float));
+		}
+		ids += chunk;
+		locations += chunk*3;
+		velocities += chunk*2;
+		position += chunk;
+		count -= chunk;
+	}
+}
+
+// Copy the current state into the snapshot ring, overwriting the oldest one
+void saveSnapshot()
+{
+	snapshotHead = (snapshotHead + 1) % NUM_SNAPSHOTS;
+	struct Snapshot *snapshot = &snapshots[snapshotHead];
+	memcpy(snapshot->state, &game, sizeof(snapshot->state));
+	snapshot->firstBullet = bulletHistoryEnd;
+	snapshot->numBullets = game.numEnemyBullets;
+	copyBulletHistory(&game, bulletHistoryEnd, game.numEnemyBullets, 0);
+	bulletHistoryEnd += game.numEnemyBullets;
+	if (numSnapshots < NUM_SNAPSHOTS) numSnapshots++;
+
+	// Forget the oldest snapshots once their bullets have been written over
+	while (numSnapshots > 1) {
+		struct Snapshot *oldest = &snapshots[(snapshotHead + NUM_SNAPSHOTS - (numSnapshots - 1)) % NUM_SNAPSHOTS];
+		if (oldest->firstBullet + BULLET_HISTORY >= bulletHistoryEnd) break;
+		numSnapshots--;
+	}
+}
+
+// Copy the state from framesAgo snapshots back (0 is the newest) into destination,
+// -1 if it's gone
+int loadSnapshot(struct GameState *destination, unsigned int framesAgo)
+{
+	if (framesAgo >= numSnapshots) return -1;
+	struct Snapshot *snapshot = &snapshots[(snapshotHead + NUM_SNAPSHOTS - framesAgo) % NUM_SNAPSHOTS];
+	memcpy(destination, snapshot->state, sizeof(snapshot->state));
+	copyBulletHistory(destination, snapshot->firstBullet, snapshot->numBullets, 1);
+	return 0;
+}
+
+int restoreSnapshot(unsigned int framesAgo)
+{
+	return loadSnapshot(&game, framesAgo);
+}
+
+// Drop the newest snapshots, e.g. after rewinding past them
+void discardSnapshots(unsigned int count)
+{
+	if (count > numSnapshots) count = numSnapshots;
+	snapshotHead = (snapshotHead + NUM_SNAPSHOTS - count) % NUM_SNAPSHOTS;
+	numSnapshots -= count;
+	// Their bullets are free to write over again
+	if (numSnapshots > 0) {
+		bulletHistoryEnd = snapshots[snapshotHead].firstBullet + snapshots[snapshotHead].numBullets;
+	}
+}
+
+// Simulation time per frame with a crowd of enemies around the player firing every pattern
+int runBulletBenchmark()
+{
+	double deltaT = 1.0/TICK_RATE;
+	aspectRatio = NET_ASPECT_RATIO;
+	initGame();
+	spawnPlayer(0);
+	// Rings of enemies just around the player, so they are all on screen and shooting
+	for (int ring = 0; ring < BULLET_BENCH_ENEMIES/40; ring++) {
+		spawnEnemies(0.0, 0.0, 0.3 + 0.025*ring, 40, ring % NUM_PATTERNS);
+	}
+	static float enemyStartLocations[3*MAX_ENEMIES];
+	memcpy(enemyStartLocations, game.enemyLocations, sizeof(enemyStartLocations));
+
+	double totalTime = 0.0;
+	double maxTime = 0.0;
+	unsigned long totalBullets = 0;
+	unsigned int maxBullets = 0;
+	for (int frame = 0; frame < BULLET_BENCH_FRAMES; frame++) {
+		// Nobody moves or dies, so the load stays the same all the way through
+		game.playerStatus[0] = PLAYER_ALIVE;
+		game.playerHealth[0] = 1.0;
+		game.playerLocations[0] = 0.0;
+		game.playerLocations[1] = 0.0;
+		memcpy(game.enemyLocations, enemyStartLocations, sizeof(enemyStartLocations));
+
+		double start = getTime();
+		updateGame(deltaT);
+		saveSnapshot();
+		double frameTime = getTime() - start;
+
+		totalTime += frameTime;
+		maxTime = (frameTime > maxTime) ? frameTime : maxTime;
+		totalBullets += game.numEnemyBullets;
+		maxBullets = (game.numEnemyBullets > maxBullets) ? game.numEnemyBullets : maxBullets;
+	}
+	printf("%u enemies: %.3f ms mean, %.3f ms max per frame (update and snapshot), %lu live bullets on average, %u at most\n",
+		game.numEnemies, totalTime/BULLET_BENCH_FRAMES*1000.0, maxTime*1000.0, totalBullets/BULLET_BENCH_FRAMES, maxBullets);
+	return 0;
+}
+
+/* Networking */
+
+// Non-blocking UDP socket, port 0 picks any free port
+int openSocket(unsigned short port)
+{
+	int netSocket = socket(AF_INET, SOCK_DGRAM, 0);
+	if (netSocket < 0) {
+		printf("Could not create socket\n");
+		return -1;
+	}
+	struct sockaddr_in address = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_ANY),
+	};
+	if (bind(netSocket, (struct sockaddr*)&address, sizeof(address)) < 0) {
+		printf("Could not bind to port %d\n", port);
+		close(netSocket);
+		return -1;
+	}
+	fcntl(netSocket, F_SETFL, O_NONBLOCK);
+	return netSocket;
+}
+
+void writeBytes(struct Packet *packet, const void *bytes, unsigned int count)
+{
+	if (packet->size + count > MAX_PACKET_SIZE) {
+		packet->overflow = 1;
+		return;
+	}
+	memcpy(packet->data + packet->size, bytes, count);
+	packet->size += count;
+}
+
+void readBytes(struct Packet *packet, void *bytes, unsigned int count)
+{
+	if (packet->readOffset + count > packet->size) {
+		packet->overflow = 1;
+		memset(bytes, 0, count);
+		return;
+	}
+	memcpy(bytes, packet->data + packet->readOffset, count);
+	packet->readOffset += count;
+}
+
+void writeU8(struct Packet *packet, unsigned char value)
+{
+	writeBytes(packet, &value, 1);
+}
+
+void writeU16(struct Packet *packet, unsigned short value)
+{
+	value = htons(value);
+	writeBytes(packet, &value, 2);
+}
+
+void writeU32(struct Packet *packet, unsigned int value)
+{
+	value = htonl(value);
+	writeBytes(packet, &value, 4);
+}
+
+unsigned char readU8(struct Packet *packet)
+{
+	unsigned char value;
+	readBytes(packet, &value, 1);
+	return value;
+}
+
+unsigned short readU16(struct Packet *packet)
+{
+	unsigned short value;
+	readBytes(packet, &value, 2);
+	return ntohs(value);
+}
+
+unsigned int readU32(struct Packet *packet)
+{
+	unsigned int value;
+	readBytes(packet, &value, 4);
+	return ntohl(value);
+}
+
+unsigned char packHealth(float health)
+{
+	if (health < 0.0) health = 0.0;
+	if (health > 1.0) health = 1.0;
+	return (unsigned char)lrintf(health*255.0);
+}
+
+// Location (x, y, angle) in the same fixed point format used for rendering
+void writeLocation(struct Packet *packet, float *location)
+{
+	writeU16(packet, (unsigned short)packCoordinate(location[0]));
+	writeU16(packet, (unsigned short)packCoordinate(location[1]));
+	writeU16(packet, packAngle(location[2]));
+}
+
+void readLocation(struct Packet *packet, float *location)
+{
+	short x = (short)readU16(packet);
+	short y = (short)readU16(packet);
+	unsigned short angle = readU16(packet);
+	location[0] = x/32767.0*ARENA_EXTENT;
+	// The "dead" marker was clamped to the arena edge, turn it back into 1024
+	location[1] = (y == 32767) ? 1024 : y/32767.0*ARENA_EXTENT;
+	location[2] = angle/65536.0*2*PI;
+}
+
+void writeVelocity(struct Packet *packet, float *velocity)
+{
+	for (int i = 0; i < 2; i++) {
+		float value = velocity[i]/NET_MAX_BULLET_SPEED;
+		if (value < -1.0) value = -1.0;
+		if (value > 1.0) value = 1.0;
+		writeU16(packet, (unsigned short)(short)lrintf(value*32767.0));
+	}
+}
+
+void readVelocity(struct Packet *packet, float *velocity)
+{
+	for (int i = 0; i < 2; i++) {
+		velocity[i] = (short)readU16(packet)/32767.0*NET_MAX_BULLET_SPEED;
+	}
+}
+
+int locationChanged(float *location, float *baseline)
+{
+	return packCoordinate(location[0]) != packCoordinate(baseline[0])
+		|| packCoordinate(location[1]) != packCoordinate(baseline[1])
+		|| packAngle(location[2]) != packAngle(baseline[2]);
+}
+
+// Write only the entities that differ from the baseline once quantized
+// health and baselineHealth are NULL for entities without health
+void writeEntityDelta(struct Packet *packet, float *locations, float *baseline, float *health, float *baselineHealth, unsigned int numEntities)
+{
+	unsigned int countOffset = packet->size;
+	unsigned short numChanged = 0;
+	writeU16(packet, 0);
+	for (int i = 0; i < numEntities; i++) {
+		int changed = locationChanged(&locations[i*3], &baseline[i*3]);
+		if (health != NULL && packHealth(health[i]) != packHealth(baselineHealth[i])) changed = 1;
+		if (!changed) continue;
+		writeU16(packet, i);
+		writeLocation(packet, &locations[i*3]);
+		if (health != NULL) writeU8(packet, packHealth(health[i]));
+		numChanged++;
+	}
+	if (!packet->overflow) {
+		numChanged = htons(numChanged);
+		memcpy(packet->data + countOffset, &numChanged, 2);
+	}
+}
+
+void readEntityDelta(struct Packet *packet, float *locations, float *health, unsigned int numEntities)
+{
+	unsigned short numChanged = readU16(packet);
+	for (int i = 0; i < numChanged && !packet->overflow; i++) {
+		unsigned short index = readU16(packet);
+		if (index >= numEntities) {
+			packet->overflow = 1;
+			return;
+		}
+		readLocation(packet, &locations[index*3]);
+		if (health != NULL) health[index] = readU8(packet)/255.0;
+	}
+}
+
+// Baseline used when the receiver has nothing acknowledged yet, every entity dead
+void initEmptyState(struct GameState *state)
+{
+	memset(state, 0, sizeof(*state));
+	for (int i = 0; i < MAX_PLAYERS; i++) state->playerLocations[i*3 + 1] = 1024;
+	for (int i = 0; i < MAX_ENEMIES; i++) state->enemyLocations[i*3 + 1] = 1024;
+	for (int i = 0; i < NUM_WORMHOLES; i++) state->wormholeInfo[i*3 + 1] = 1024;
+	for (int i = 0; i < NUM_PLAYER_BULLETS; i++) state->playerBulletLocations[i*3 + 1] = 1024;
+}
+
+// Enemy bullets fly in straight lines, so the receiver moves the ones it already has
+// itself and only needs the ids of the ones that died and the new ones in full. The
+// receiver has every bullet in the baseline with an id below baselineKnownId, returns
+// the same for this snapshot (it's lower than nextEnemyBulletId if the new bullets
+// didn't all fit)
+unsigned int writeSnapshot(struct Packet *packet, struct GameState *state, struct GameState *baseline, unsigned int baselineKnownId)
+{
+	for (int i = 0; i < MAX_PLAYERS; i++) {
+		writeU8(packet, state->playerStatus[i]);
+		writeLocation(packet, &state->playerLocations[i*3]);
+		writeU8(packet, packHealth(state->playerHealth[i]));
+	}
+	writeU32(packet, state->score);
+	writeU16(packet, state->numEnemies);
+	writeEntityDelta(packet, state->enemyLocations, baseline->enemyLocations, state->enemyHealth, baseline->enemyHealth, MAX_ENEMIES);
+	writeEntityDelta(packet, state->wormholeInfo, baseline->wormholeInfo, state->wormholeHealth, baseline->wormholeHealth, NUM_WORMHOLES);
+	writeEntityDelta(packet, state->playerBulletLocations, baseline->playerBulletLocations, NULL, NULL, NUM_PLAYER_BULLETS);
+
+	// Both lists are sorted by id, so the dead ones fall out of a single pass over the two
+	unsigned int countOffset = packet->size;
+	unsigned short numRemoved = 0;
+	unsigned int bullet = 0;
+	writeU16(packet, 0);
+	for (int i = 0; i < baseline->numEnemyBullets && baseline->enemyBulletIds[i] < baselineKnownId; i++) {
+		unsigned int id = baseline->enemyBulletIds[i];
+		while (bullet < state->numEnemyBullets && state->enemyBulletIds[bullet] < id) bullet++;
+		if (bullet < state->numEnemyBullets && state->enemyBulletIds[bullet] == id) continue;
+		writeU32(packet, id);
+		numRemoved++;
+	}
+	if (!packet->overflow) {
+		numRemoved = htons(numRemoved);
+		memcpy(packet->data + countOffset, &numRemoved, 2);
+	}
+
+	unsigned int knownId = state->nextEnemyBulletId;
+	unsigned short numNew = 0;
+	countOffset = packet->size;
+	writeU16(packet, 0);
+	for (bullet = 0; bullet < state->numEnemyBullets; bullet++) {
+		if (state->enemyBulletIds[bullet] < baselineKnownId) continue;
+		if (numNew == NET_MAX_NEW_ENEMY_BULLETS) {
+			knownId = state->enemyBulletIds[bullet];
+			break;
+		}
+		writeU32(packet, state->enemyBulletIds[bullet]);
+		writeLocation(packet, &state->enemyBulletLocations[bullet*3]);
+		writeVelocity(packet, &state->enemyBulletVelocities[bullet*2]);
+		numNew++;
+	}
+	if (!packet->overflow) {
+		numNew = htons(numNew);
+		memcpy(packet->data + countOffset, &numNew, 2);
+	}
+	return knownId;
+}
+
+// state must start out as a copy of the baseline the snapshot was written against,
+// elapsed is the time from the baseline to this snapshot
+void readSnapshot(struct Packet *packet, struct GameState *state, float elapsed)
+{
+	for (int i = 0; i < MAX_PLAYERS; i++) {
+		state->playerStatus[i] = readU8(packet);
+		readLocation(packet, &state->playerLocations[i*3]);
+		state->playerHealth[i] = readU8(packet)/255.0;
+	}
+	state->score = readU32(packet);
+	state->numEnemies = readU16(packet);
+	if (state->numEnemies > MAX_ENEMIES) {
+		packet->overflow = 1;
+		return;
+	}
+	readEntityDelta(packet, state->enemyLocations, state->enemyHealth, MAX_ENEMIES);
+	readEntityDelta(packet, state->wormholeInfo, state->wormholeHealth, NUM_WORMHOLES);
+	readEntityDelta(packet, state->playerBulletLocations, NULL, NUM_PLAYER_BULLETS);
+
+	// Catch the bullets we have up, then drop the dead ones (in id order like ours)
+	unsigned int *ids = state->enemyBulletIds;
+	float *locations = state->enemyBulletLocations;
+	float *velocities = state->enemyBulletVelocities;
+	for (int i = 0; i < state->numEnemyBullets; i++) {
+		locations[i*3] += velocities[i*2]*elapsed;
+		locations[i*3 + 1] += velocities[i*2 + 1]*elapsed;
+	}
+	unsigned short numRemoved = readU16(packet);
+	unsigned int live = 0;
+	unsigned int bullet = 0;
+	for (int i = 0; i < numRemoved && !packet->overflow; i++) {
+		unsigned int id = readU32(packet);
+		for (; bullet < state->numEnemyBullets && ids[bullet] <= id; bullet++) {
+			if (ids[bullet] == id) continue;
+			ids[live] = ids[bullet];
+			memcpy(&locations[live*3], &locations[bullet*3], 3*sizeof(float));
+			memcpy(&velocities[live*2], &velocities[bullet*2], 2*sizeof(float));
+			live++;
+		}
+	}
+	for (; bullet < state->numEnemyBullets; bullet++, live++) {
+		ids[live] = ids[bullet];
+		memcpy(&locations[live*3], &locations[bullet*3], 3*sizeof(float));
+		memcpy(&velocities[live*2], &velocities[bullet*2], 2*sizeof(float));
+	}
+	state->numEnemyBullets = live;
+
+	// New ones always come after all the ones we have
+	unsigned short numNew = readU16(packet);
+	if (numNew > MAX_ENEMY_BULLETS - live) {
+		packet->overflow = 1;
+		return;
+	}
+	for (int i = 0; i < numNew && !packet->overflow; i++) {
+		unsigned int id = readU32(packet);
+		if (live > 0 && id <= ids[live - 1]) {
+			packet->overflow = 1;
+			return;
+		}
+		ids[live] = id;
+		readLocation(packet, &locations[live*3]);
+		readVelocity(packet, &velocities[live*2]);
+		live++;
+	}
+	state->numEnemyBullets = live;
+}
 
-double playerRotationRate = 0.0;
-int isShooting = 0;
+/* Server */
 
-unsigned int VBO;
-unsigned int IBO;
-unsigned int instanceVBO;
-unsigned int VBOindex = 0;
-unsigned int IBOindex = 0;
-unsigned int instanceVBOindex = 0;
-unsigned int numObjects = 0;
-struct Object *objects[MAX_OBJECTS];
+struct Client
+{
+	int isConnected;
+	struct sockaddr_in address;
+	double lastHeardTime;
+	unsigned int ackTick; // Newest snapshot the client has received
+	unsigned int newestInput; // Newest input sequence number received
+	unsigned int processedInput; // Newest input sequence number simulated
+	unsigned char inputs[INPUT_QUEUE];
+	unsigned char lastInput;
+	unsigned int knownBulletIds[NUM_SNAPSHOTS]; // What writeSnapshot() returned for each tick sent
+
+	// Totals for the current report interval
+	unsigned int bytesSent;
+	unsigned int bytesReceived;
+	double roundTripTime;
+};
 
+struct Client clients[MAX_PLAYERS];
+unsigned int serverTick = 0;
+double tickSendTime[NUM_SNAPSHOTS];
 
-int render()
+struct Client *findClient(struct sockaddr_in *address)
 {
-	/* Set background to black */
-	glClear(GL_COLOR_BUFFER_BIT);
-
-	/* Render objects */
-	glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
-	for (int i = 0; i < numObjects; i++) {
-		GLsizei numInstances = objects[i]->numInstances;
-		GLenum drawMode = objects[i]->drawMode;
-		GLsizei numIndices = objects[i]->indicesSize/sizeof(unsigned int);
-		void* objectIBOindex = (void*)(long)(objects[i]->IBOindex);
-		if (numInstances == 1) {
-			glDrawElements(drawMode, numIndices, GL_UNSIGNED_INT, objectIBOindex);
-		} else {
-			void* objectInstanceVBOindex = (void*)(long)(objects[i]->instanceVBOindex);
-			glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 3*sizeof(float), objectInstanceVBOindex);
-			glDrawElementsInstanced(drawMode, numIndices, GL_UNSIGNED_INT, objectIBOindex, numInstances);
+	for (int i = 0; i < MAX_PLAYERS; i++) {
+		if (!clients[i].isConnected) continue;
+		if (clients[i].address.sin_addr.s_addr == address->sin_addr.s_addr && clients[i].address.sin_port == address->sin_port) {
+			return &clients[i];
 		}
 	}
-
-	/* Wait for vertical refresh then swap buffers */
-	glfwSwapBuffers(window);
-	return 0;
+	return NULL;
 }
 
-static unsigned int compileShader(unsigned int type, const char* source)
+// A client joins by sending its first input packet
+struct Client *addClient(struct sockaddr_in *address)
 {
-	unsigned int id = glCreateShader(type);
-	glShaderSource(id, 1, &source, nullptr);
-	glCompileShader(id);
-
-	// Error Checking
-	int result;
-	glGetShaderiv(id, GL_COMPILE_STATUS, &result);
-	if (result == GL_FALSE) {
-		int length;
-		glGetShaderiv(id, GL_INFO_LOG_LENGTH, &length);
-		char* message = (char*)alloca(length*sizeof(char));
-		glGetShaderInfoLog(id, length, &length, message);
-		printf("Failed to compile shader\n");
-		printf("%s\n", message);
-		glDeleteShader(id);
-		return 0;
+	for (int i = 0; i < MAX_PLAYERS; i++) {
+		if (clients[i].isConnected) continue;
+		memset(&clients[i], 0, sizeof(clients[i]));
+		clients[i].isConnected = 1;
+		clients[i].address = *address;
+		clients[i].ackTick = NO_TICK;
+		spawnPlayer(i);
+		printf("Client %d joined from %s:%d\n", i, inet_ntoa(address->sin_addr), ntohs(address->sin_port));
+		return &clients[i];
 	}
-
-	return id;
+	return NULL;
 }
 
-static unsigned int createShader(const char* vertexShader, const char* fragmentShader)
+void serverReceive(int netSocket, double now)
 {
-	unsigned int program = glCreateProgram();
-	unsigned int vs = compileShader(GL_VERTEX_SHADER, vertexShader);
-	unsigned int fs = compileShader(GL_FRAGMENT_SHADER, fragmentShader);
-	glAttachShader(program, vs);
-	glAttachShader(program, fs);
-	glLinkProgram(program);
-	glValidateProgram(program);
-	glDeleteShader(vs);
-	glDeleteShader(fs);
+	static struct Packet packet;
+	struct sockaddr_in address;
+	socklen_t addressSize = sizeof(address);
+	ssize_t bytesRead;
+	while ((bytesRead = recvfrom(netSocket, packet.data, MAX_PACKET_SIZE, 0, (struct sockaddr*)&address, &addressSize)) > 0) {
+		packet.size = bytesRead;
+		packet.readOffset = 0;
+		packet.overflow = 0;
+		if (readU8(&packet) != PACKET_INPUT) continue;
+		unsigned int ackTick = readU32(&packet);
+		unsigned int newestInput = readU32(&packet);
+		unsigned char numInputs = readU8(&packet);
+		if (packet.overflow || numInputs > INPUT_REDUNDANCY || numInputs > newestInput) continue;
+
+		struct Client *client = findClient(&address);
+		if (client == NULL) client = addClient(&address);
+		if (client == NULL) continue; // Server full
+		client->lastHeardTime = now;
+		client->bytesReceived += bytesRead;
+
+		// Round trip time from the first ack of each snapshot
+		if (ackTick != NO_TICK && ackTick <= serverTick && (client->ackTick == NO_TICK || ackTick > client->ackTick)) {
+			if (serverTick - ackTick < NUM_SNAPSHOTS) {
+				double sample = now - tickSendTime[ackTick % NUM_SNAPSHOTS];
+				client->roundTripTime = (client->roundTripTime == 0.0) ? sample : 0.9*client->roundTripTime + 0.1*sample;
+			}
+			client->ackTick = ackTick;
+		}
 
-	return program;
+		// Inputs are resent several times, only keep the new ones
+		for (unsigned int i = 0; i < numInputs; i++) {
+			unsigned int sequence = newestInput - numInputs + 1 + i;
+			unsigned char input = readU8(&packet);
+			if (sequence <= client->newestInput) continue;
+			client->inputs[sequence % INPUT_QUEUE] = input;
+		}
+		if (newestInput > client->newestInput) client->newestInput = newestInput;
+	}
 }
 
-static unsigned int createShaderFromFiles(char* vertexFileName, char* fragmentFileName)
+// Use one queued input per client per tick, repeating the last one if none arrived
+void serverConsumeInputs()
 {
-	FILE *vertexFile = fopen(vertexFileName, "r");
-	if (vertexFile == NULL) {
-		printf("Could not read vertex shader file: %s\n", vertexFileName);
-		glfwTerminate();
-		exit(-1);
-	}
-	char* vertexShader = NULL;
-	size_t vertexShaderLen;
-	ssize_t vertexBytesRead = getdelim(&vertexShader, &vertexShaderLen, '\0', vertexFile);
-	if (vertexBytesRead == -1) {
-		printf("Error reading vertex shader file: %s\n", vertexFileName);
-		glfwTerminate();
-		exit(-1);
+	for (int i = 0; i < MAX_PLAYERS; i++) {
+		struct Client *client = &clients[i];
+		playerInputs[i] = 0;
+		if (!client->isConnected) continue;
+		if (client->newestInput - client->processedInput > INPUT_QUEUE/2) {
+			// Fallen too far behind, drop the backlog rather than add latency
+			client->processedInput = client->newestInput - 1;
+		}
+		if (client->processedInput < client->newestInput) {
+			client->processedInput++;
+			client->lastInput = client->inputs[client->processedInput % INPUT_QUEUE];
+		}
+		playerInputs[i] = client->lastInput;
 	}
+}
 
-	FILE *fragmentFile = fopen(fragmentFileName, "r");
-	if (fragmentFile == NULL) {
-		printf("Could not read fragment shader file: %s\n", fragmentFileName);
-		glfwTerminate();
-		exit(-1);
-	}
-	char* fragmentShader = NULL;
-	size_t fragmentShaderLen;
-	ssize_t fragmentBytesRead = getdelim(&fragmentShader, &fragmentShaderLen, '\0', fragmentFile);
-	if (fragmentBytesRead == -1) {
-		printf("Error reading fragment shader file: %s\n", fragmentFileName);
-		glfwTerminate();
-		exit(-1);
+void serverSendSnapshots(int netSocket, double now)
+{
+	static struct Packet packet;
+	static struct GameState emptyState;
+	static struct GameState acked;
+	static int isEmptyStateReady = 0;
+	if (!isEmptyStateReady) {
+		initEmptyState(&emptyState);
+		isEmptyStateReady = 1;
 	}
 
-	unsigned int shader = createShader(vertexShader, fragmentShader);
-	free(vertexShader);
-	free(fragmentShader);
-	return shader;
+	tickSendTime[serverTick % NUM_SNAPSHOTS] = now;
+	for (int i = 0; i < MAX_PLAYERS; i++) {
+		struct Client *client = &clients[i];
+		if (!client->isConnected) continue;
+
+		// Delta against the newest state the client has, if it is still in history
+		unsigned int baselineTick = NO_TICK;
+		struct GameState *baseline = &emptyState;
+		unsigned int baselineKnownId = 0;
+		if (client->ackTick != NO_TICK && loadSnapshot(&acked, serverTick - client->ackTick) == 0) {
+			baselineTick = client->ackTick;
+			baseline = &acked;
+			baselineKnownId = client->knownBulletIds[baselineTick % NUM_SNAPSHOTS];
+		}
+
+		// If too much has changed since then, start the client over from nothing
+		for (int attempt = 0; attempt < 2; attempt++) {
+			packet.size = 0;
+			packet.overflow = 0;
+			writeU8(&packet, PACKET_SNAPSHOT);
+			writeU32(&packet, serverTick);
+			writeU32(&packet, baselineTick);
+			writeU8(&packet, i);
+			writeU32(&packet, client->processedInput);
+			client->knownBulletIds[serverTick % NUM_SNAPSHOTS] = writeSnapshot(&packet, &game, baseline, baselineKnownId);
+			if (!packet.overflow || baseline == &emptyState) break;
+			baselineTick = NO_TICK;
+			baseline = &emptyState;
+			baselineKnownId = 0;
+		}
+		if (packet.overflow) {
+			printf("Snapshot for client %d does not fit in a packet\n", i);
+			continue;
+		}
+		sendto(netSocket, packet.data, packet.size, 0, (struct sockaddr*)&client->address, sizeof(client->address));
+		client->bytesSent += packet.size;
+	}
 }
 
-int isKeyDown(int key)
+void serverReport(double now, double interval)
 {
-	return glfwGetKey(window, key) == GLFW_PRESS;
+	for (int i = 0; i < MAX_PLAYERS; i++) {
+		struct Client *client = &clients[i];
+		if (!client->isConnected) continue;
+		printf("Client %d %s:%d  down %.2f KB/s  up %.2f KB/s  RTT %.2f ms  input backlog %u\n",
+			i, inet_ntoa(client->address.sin_addr), ntohs(client->address.sin_port),
+			client->bytesSent/interval/1024.0, client->bytesReceived/interval/1024.0,
+			client->roundTripTime*1000.0, client->newestInput - client->processedInput);
+		client->bytesSent = 0;
+		client->bytesReceived = 0;
+	}
+	fflush(stdout);
 }
 
-void handleKeyboardInput(float deltaT, unsigned int shader)
+// Dedicated server, runs the simulation headless at a fixed tick rate
+int runServer(unsigned short port)
 {
-	glfwPollEvents();
-	float playerSpeed = 1.2*deltaT;
+	int netSocket = openSocket(port);
+	if (netSocket < 0) return -1;
+	printf("Server listening on UDP port %d\n", port);
+
+	aspectRatio = NET_ASPECT_RATIO;
+	initGame();
+	double nextTick = getTime();
+	double nextReport = nextTick + REPORT_INTERVAL;
+	while (1) {
+		double now = getTime();
+		serverReceive(netSocket, now);
+
+		// Drop clients that went quiet
+		for (int i = 0; i < MAX_PLAYERS; i++) {
+			if (clients[i].isConnected && now - clients[i].lastHeardTime > CLIENT_TIMEOUT) {
+				printf("Client %d timed out\n", i);
+				clients[i].isConnected = 0;
+				game.playerStatus[i] = PLAYER_INACTIVE;
+				game.playerLocations[i*3 + 1] = 1024;
+			}
+		}
 
-	/* Escape to Quit Game */
-	if (isKeyDown(GLFW_KEY_ESCAPE)) {
-		glDeleteProgram(shader);
-		glfwTerminate();
-		exit(0);
-	}
+		serverConsumeInputs();
+		int allEnemiesDead = updateGame(1.0/TICK_RATE);
 
-	/* Shooting */
-	isShooting = isKeyDown(GLFW_KEY_SPACE);
+		// Start a new round once everyone has won or died
+		int anyoneConnected = 0;
+		int anyoneAlive = 0;
+		for (int i = 0; i < MAX_PLAYERS; i++) {
+			anyoneConnected |= clients[i].isConnected;
+			anyoneAlive |= game.playerStatus[i] == PLAYER_ALIVE;
+		}
+		if (anyoneConnected && (allEnemiesDead || !anyoneAlive)) {
+			printf(allEnemiesDead ? "Round won\n" : "Round lost\n");
+			initGame();
+			for (int i = 0; i < MAX_PLAYERS; i++) {
+				if (clients[i].isConnected) spawnPlayer(i);
+			}
+		}
 
-	/* Player Movement */
-	playerRotationRate = 0.0;
-	if (isKeyDown(GLFW_KEY_LEFT)) {
-		playerRotationRate += -5.0;
-	}
-	if (isKeyDown(GLFW_KEY_RIGHT)) {
-		playerRotationRate += 5.0;
-	}
-	if (isKeyDown(GLFW_KEY_LEFT_SHIFT)) {
-		playerRotationRate *= 0.5;
+		serverTick++;
+		saveSnapshot();
+		serverSendSnapshots(netSocket, now);
+
+		if (now >= nextReport) {
+			serverReport(now, REPORT_INTERVAL);
+			nextReport += REPORT_INTERVAL;
+		}
+
+		nextTick += 1.0/TICK_RATE;
+		if (nextTick < now) nextTick = now; // Don't try to catch up after a stall
+		sleepUntil(nextTick);
 	}
-	int wPressed = isKeyDown(GLFW_KEY_W);
-	int aPressed = isKeyDown(GLFW_KEY_A);
-	int sPressed = isKeyDown(GLFW_KEY_S);
-	int dPressed = isKeyDown(GLFW_KEY_D);
+	return 0;
+}
 
-	// Detect if moving on X and Y axis at the same time
-	float speedMultiplier = 1.0;
-	playerVelocityX = 0.0;
-	playerVelocityY = 0.0;
-	if (wPressed != sPressed && aPressed != dPressed) {
-		speedMultiplier = sqrt(2.0)/2.0;
+/* Client */
+
+int clientSocket = -1;
+struct sockaddr_in serverAddress;
+unsigned int inputSequence = 0;
+unsigned char inputHistory[INPUT_HISTORY];
+double inputSendTime[INPUT_HISTORY];
+unsigned int latestTick = NO_TICK;
+unsigned int latestProcessedInput = 0;
+struct GameState baselines[NUM_BASELINES];
+unsigned int baselineTicks[NUM_BASELINES];
+double clientTickTime = 0.0;
+unsigned int clientBytesSent = 0;
+unsigned int clientBytesReceived = 0;
+double clientRoundTripTime = 0.0;
+
+int clientConnect(char *host, unsigned short port)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_INET,
+		.ai_socktype = SOCK_DGRAM,
+	};
+	struct addrinfo *result;
+	if (getaddrinfo(host, NULL, &hints, &result) != 0) {
+		printf("Could not resolve %s\n", host);
+		return -1;
 	}
-	if (wPressed) {
-		playerVelocityY += speedMultiplier*playerSpeed*cos(playerAngle);
-		playerVelocityX += speedMultiplier*playerSpeed*sin(playerAngle);
+	serverAddress = *(struct sockaddr_in*)result->ai_addr;
+	serverAddress.sin_port = htons(port);
+	freeaddrinfo(result);
+
+	clientSocket = openSocket(0);
+	if (clientSocket < 0) return -1;
+	for (int i = 0; i < NUM_BASELINES; i++) baselineTicks[i] = NO_TICK;
+	initEmptyState(&game);
+	printf("Connecting to %s:%d\n", inet_ntoa(serverAddress.sin_addr), port);
+	return 0;
+}
+
+// Send this tick's input (plus a few older ones in case of loss) and predict its effect
+void clientSendInput(unsigned char input)
+{
+	static struct Packet packet;
+	inputSequence++;
+	inputHistory[inputSequence % INPUT_HISTORY] = input;
+	inputSendTime[inputSequence % INPUT_HISTORY] = getTime();
+
+	unsigned char numInputs = (inputSequence < INPUT_REDUNDANCY) ? inputSequence : INPUT_REDUNDANCY;
+	packet.size = 0;
+	packet.overflow = 0;
+	writeU8(&packet, PACKET_INPUT);
+	writeU32(&packet, latestTick);
+	writeU32(&packet, inputSequence);
+	writeU8(&packet, numInputs);
+	for (unsigned int sequence = inputSequence - numInputs + 1; sequence <= inputSequence; sequence++) {
+		writeU8(&packet, inputHistory[sequence % INPUT_HISTORY]);
 	}
-	if (aPressed) {
-		playerVelocityY += speedMultiplier*playerSpeed*sin(playerAngle);
-		playerVelocityX -= speedMultiplier*playerSpeed*cos(playerAngle);
+	sendto(clientSocket, packet.data, packet.size, 0, (struct sockaddr*)&serverAddress, sizeof(serverAddress));
+	clientBytesSent += packet.size;
+
+	if (game.playerStatus[localPlayer] == PLAYER_ALIVE) {
+		applyInput(localPlayer, input, 1.0/TICK_RATE);
 	}
-	if (sPressed) {
-		playerVelocityY -= speedMultiplier*playerSpeed*cos(playerAngle);
-		playerVelocityX -= speedMultiplier*playerSpeed*sin(playerAngle);
+}
+
+void clientReceive()
+{
+	static struct Packet packet;
+	static struct GameState emptyState;
+	static struct GameState received;
+	static int isEmptyStateReady = 0;
+	if (!isEmptyStateReady) {
+		initEmptyState(&emptyState);
+		isEmptyStateReady = 1;
 	}
-	if (dPressed) {
-		playerVelocityY -= speedMultiplier*playerSpeed*sin(playerAngle);
-		playerVelocityX += speedMultiplier*playerSpeed*cos(playerAngle);
+
+	ssize_t bytesRead;
+	while ((bytesRead = recv(clientSocket, packet.data, MAX_PACKET_SIZE, 0)) > 0) {
+		packet.size = bytesRead;
+		packet.readOffset = 0;
+		packet.overflow = 0;
+		clientBytesReceived += bytesRead;
+		if (readU8(&packet) != PACKET_SNAPSHOT) continue;
+		unsigned int tick = readU32(&packet);
+		unsigned int baselineTick = readU32(&packet);
+		unsigned char player = readU8(&packet);
+		unsigned int processedInput = readU32(&packet);
+		if (packet.overflow || player >= MAX_PLAYERS) continue;
+		if (latestTick != NO_TICK && tick <= latestTick) continue; // Old or duplicate
+
+		struct GameState *baseline = &emptyState;
+		if (baselineTick != NO_TICK) {
+			if (baselineTicks[baselineTick % NUM_BASELINES] != baselineTick) continue;
+			baseline = &baselines[baselineTick % NUM_BASELINES];
+		}
+		copyGameState(&received, baseline);
+		readSnapshot(&packet, &received, (baselineTick != NO_TICK) ? (tick - baselineTick)/TICK_RATE : 0.0);
+		if (packet.overflow) continue;
+
+		copyGameState(&baselines[tick % NUM_BASELINES], &received);
+		baselineTicks[tick % NUM_BASELINES] = tick;
+		latestTick = tick;
+		localPlayer = player;
+
+		if (processedInput > latestProcessedInput && inputSequence - processedInput < INPUT_HISTORY) {
+			double sample = getTime() - inputSendTime[processedInput % INPUT_HISTORY];
+			clientRoundTripTime = (clientRoundTripTime == 0.0) ? sample : 0.9*clientRoundTripTime + 0.1*sample;
+		}
+		if (processedInput > latestProcessedInput) latestProcessedInput = processedInput;
+
+		// Take the server's word for everything, then replay the inputs it hasn't seen yet
+		copyGameState(&game, &received);
+		if (game.playerStatus[localPlayer] == PLAYER_ALIVE && inputSequence - latestProcessedInput < INPUT_HISTORY) {
+			for (unsigned int sequence = latestProcessedInput + 1; sequence <= inputSequence; sequence++) {
+				applyInput(localPlayer, inputHistory[sequence % INPUT_HISTORY], 1.0/TICK_RATE);
+			}
+		}
 	}
-	playerX += playerVelocityX;
-	playerY += playerVelocityY;
 }
 
-int createCircle(float *circleVertices, unsigned int *circleIndices, float type, int numSides)
+// Inputs go out at the server's tick rate no matter what the frame rate is
+void clientUpdate(double deltaT, unsigned char input)
 {
-	for (int i = 0; i < numSides; i++) {
-		double angle = (float)i/numSides*2*PI;
-		circleVertices[i*3] = cos(angle);
-		circleVertices[i*3 + 1] = sin(angle);
-		circleVertices[i*3 + 2] = type;
-		circleIndices[i] = i;
+	clientTickTime += deltaT;
+	if (clientTickTime > 0.25) clientTickTime = 0.25; // Don't flood the server after a stall
+	while (clientTickTime >= 1.0/TICK_RATE) {
+		clientTickTime -= 1.0/TICK_RATE;
+		clientSendInput(input);
 	}
-	return 0;
+	clientReceive();
 }
 
-int isOnScreen(float x, float y)
+void clientReport(double interval)
 {
-	float deltaX = x - playerX;
-	float deltaY = y - playerY;
-	return deltaX >= -aspectRatio*1.0 && deltaX <= aspectRatio*1.0 && deltaY >= -1.0 && deltaY <= 1.0;
+	printf("Player %d  down %.2f KB/s  up %.2f KB/s  RTT %.2f ms  tick %u\n",
+		localPlayer, clientBytesReceived/interval/1024.0, clientBytesSent/interval/1024.0,
+		clientRoundTripTime*1000.0, latestTick);
+	clientBytesSent = 0;
+	clientBytesReceived = 0;
+	fflush(stdout);
 }
 
-int spawnBullet(float *bulletLocations, float *bulletVelocities, int numBullets, float x, float y, float angle, float deltaT, float velocity)
+// Headless client that flies around and shoots, for testing over loopback
+int runBot()
 {
-	for (int i = 0; i < numBullets; i++) {
-		if (isOnScreen(bulletLocations[i*3], bulletLocations[i*3 + 1])) continue;
-		bulletLocations[i*3] = x;
-		bulletLocations[i*3 + 1] = y;
-		bulletLocations[i*3 + 2] = angle;
-		bulletVelocities[i*2] = velocity*sin(angle)*deltaT;
-		bulletVelocities[i*2 + 1] = velocity*cos(angle)*deltaT;
-		break;
+	unsigned char input = INPUT_SHOOT;
+	double lastTime = getTime();
+	double nextReport = lastTime + REPORT_INTERVAL;
+	double nextInputChange = lastTime;
+	while (1) {
+		double now = getTime();
+		if (now >= nextInputChange) {
+			input = (rand() & 0x7f) | INPUT_SHOOT;
+			nextInputChange = now + 0.5;
+		}
+		clientUpdate(now - lastTime, input);
+		lastTime = now;
+		if (now >= nextReport) {
+			clientReport(REPORT_INTERVAL);
+			nextReport += REPORT_INTERVAL;
+		}
+		sleepUntil(now + 1.0/TICK_RATE);
 	}
 	return 0;
 }
 
-
 int addObject(struct Object *object) {
 	objects[numObjects] = object;
 	numObjects++;
@@ -283,16 +3156,16 @@ int addObject(struct Object *object) {
 	}
 
 	for (int i = 0; i < object->indicesSize/sizeof(unsigned int); i++) {
-		object->indices[i] += VBOindex/sizeof(float)/3;
+		object->indices[i] += VBOindex/sizeof(struct PackedVertex);
 	}
 
 	object->VBOindex = VBOindex;
 	object->IBOindex = IBOindex;
 	object->instanceVBOindex = instanceVBOindex;
 
-	VBOindex += object->verticesSize;
+	VBOindex += packedVerticesSize(object);
 	IBOindex += object->indicesSize;
-	instanceVBOindex += object->instancesSize;
+	instanceVBOindex += packedInstancesSize(object);
 	return 0;
 }
 
@@ -302,7 +3175,9 @@ int initObjects() {
 	glBufferData(GL_ARRAY_BUFFER, VBOindex, 0, GL_STATIC_DRAW);
 
 	glEnableVertexAttribArray(0); // Vertices
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(float)*3, (void*)0);
+	glVertexAttribPointer(0, 2, GL_HALF_FLOAT, GL_FALSE, sizeof(struct PackedVertex), (void*)0);
+	glEnableVertexAttribArray(2); // Type
+	glVertexAttribIPointer(2, 1, GL_UNSIGNED_BYTE, sizeof(struct PackedVertex), (void*)offsetof(struct PackedVertex, type));
 
 	glGenBuffers(1, &IBO);
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, IBO);
@@ -312,13 +3187,25 @@ int initObjects() {
 	glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
 	glBufferData(GL_ARRAY_BUFFER, instanceVBOindex, 0, GL_DYNAMIC_DRAW);
 
-	glEnableVertexAttribArray(1); // Info
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 3*sizeof(float), (void*)0);
+	glEnableVertexAttribArray(1); // Instance position
+	glVertexAttribPointer(1, 2, GL_SHORT, GL_TRUE, sizeof(struct PackedInstance), (void*)0);
 	glVertexAttribDivisor(1, 1);
+	glEnableVertexAttribArray(3); // Instance angle
+	glVertexAttribPointer(3, 1, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(struct PackedInstance), (void*)offsetof(struct PackedInstance, angle));
+	glVertexAttribDivisor(3, 1);
 
 	glBindBuffer(GL_ARRAY_BUFFER, VBO);
 	for (int i = 0; i < numObjects; i++) {
-		glBufferSubData(GL_ARRAY_BUFFER, objects[i]->VBOindex, objects[i]->verticesSize, objects[i]->vertices);
+		unsigned int numVertices = objects[i]->verticesSize/(2*sizeof(float));
+		// Zeroed so the padding bytes going into the VBO are too
+		struct PackedVertex *packed = calloc(1, packedVerticesSize(objects[i]));
+		for (int j = 0; j < numVertices; j++) {
+			packed[j].x = floatToHalf(objects[i]->vertices[j*2]);
+			packed[j].y = floatToHalf(objects[i]->vertices[j*2 + 1]);
+			packed[j].type = objects[i]->type;
+		}
+		glBufferSubData(GL_ARRAY_BUFFER, objects[i]->VBOindex, packedVerticesSize(objects[i]), packed);
+		free(packed);
 	}
 
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, IBO);
@@ -326,24 +3213,136 @@ int initObjects() {
 		glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, objects[i]->IBOindex, objects[i]->indicesSize, objects[i]->indices);
 	}
 
+	// Staging buffer big enough for the largest instanced object
+	unsigned int maxInstances = 0;
+	for (int i = 0; i < numObjects; i++) {
+		unsigned int numInstances = objects[i]->instancesSize/(3*sizeof(float));
+		maxInstances = (numInstances > maxInstances) ? numInstances : maxInstances;
+	}
+	instanceStaging = malloc((maxInstances + 1)*sizeof(struct PackedInstance));
+
 	glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
 	for (int i = 0; i < numObjects; i++) {
-		glBufferSubData(GL_ARRAY_BUFFER, objects[i]->instanceVBOindex, objects[i]->instancesSize, objects[i]->instances);
+		unsigned int numPacked = packInstances(objects[i]);
+		glBufferSubData(GL_ARRAY_BUFFER, objects[i]->instanceVBOindex, numPacked*sizeof(struct PackedInstance), instanceStaging);
 	}
 	return 0;
 }
 
 int updateObject(struct Object *object) {
+	unsigned int numPacked = packInstances(object);
 	glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
-	glBufferSubData(GL_ARRAY_BUFFER, object->instanceVBOindex, object->instancesSize, object->instances);
+	glBufferSubData(GL_ARRAY_BUFFER, object->instanceVBOindex, numPacked*sizeof(struct PackedInstance), instanceStaging);
 	return 0;
 }
 
-int main(void)
+int main(int argc, char **argv)
 {
 
 	srand(time(NULL));
 
+	// Command line
+	char *serverHost = NULL;
+	unsigned short port = SERVER_PORT;
+	int isServer = 0;
+	int isBot = 0;
+	int showStats = 0;
+	int isAudioBenchmark = 0;
+	int isSpawnBenchmark = 0;
+	int isBulletBenchmark = 0;
+	audioBackend = AUDIO_APLAY;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--server")) {
+			isServer = 1;
+		} else if (!strcmp(argv[i], "--connect") && i + 1 < argc) {
+			serverHost = argv[++i];
+		} else if (!strcmp(argv[i], "--port") && i + 1 < argc) {
+			port = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--bot")) {
+			isBot = 1;
+		} else if (!strcmp(argv[i], "--pacing") && i + 1 < argc) {
+			i++;
+			pacingMode = -1;
+			for (int mode = 0; mode < NUM_PACING_MODES; mode++) {
+				if (!strcmp(argv[i], pacingModeNames[mode])) pacingMode = mode;
+			}
+			if (pacingMode == -1) {
+				printf("Unknown pacing mode: %s\n", argv[i]);
+				return -1;
+			}
+		} else if (!strcmp(argv[i], "--fps") && i + 1 < argc) {
+			frameRateCap = atof(argv[++i]);
+			if (!(frameRateCap > 0.0)) {
+				printf("Frame rate cap has to be above 0: %s\n", argv[i]);
+				return -1;
+			}
+			pacingMode = PACING_CAPPED;
+		} else if (!strcmp(argv[i], "--frames-in-flight") && i + 1 < argc) {
+			framesInFlight = atoi(argv[++i]);
+			if (framesInFlight < 1) framesInFlight = 1;
+			if (framesInFlight > MAX_FRAMES_IN_FLIGHT) framesInFlight = MAX_FRAMES_IN_FLIGHT;
+		} else if (!strcmp(argv[i], "--no-dynamic-resolution")) {
+			isDynamicResolution = 0;
+		} else if (!strcmp(argv[i], "--resolution-scale") && i + 2 < argc) {
+			minResolutionScale = atof(argv[++i]);
+			maxResolutionScale = atof(argv[++i]);
+			if (!(minResolutionScale > 0.0 && minResolutionScale <= maxResolutionScale && maxResolutionScale <= 1.0)) {
+				printf("Resolution scales have to be in (0, 1] with min no bigger than max: %s %s\n", argv[i - 1], argv[i]);
+				return -1;
+			}
+		} else if (!strcmp(argv[i], "--stats")) {
+			showStats = 1;
+		} else if (!strcmp(argv[i], "--audio") && i + 1 < argc) {
+			i++;
+			audioBackend = -1;
+			for (int backend = 0; backend < NUM_AUDIO_BACKENDS; backend++) {
+				if (!strcmp(argv[i], audioBackendNames[backend])) audioBackend = backend;
+			}
+			if (audioBackend == -1) {
+				printf("Unknown audio backend: %s\n", argv[i]);
+				return -1;
+			}
+		} else if (!strcmp(argv[i], "--audio-file") && i + 1 < argc) {
+			audioFileName = argv[++i];
+			audioBackend = AUDIO_WAV;
+		} else if (!strcmp(argv[i], "--audio-bench")) {
+			isAudioBenchmark = 1;
+		} else if (!strcmp(argv[i], "--spawn-bench")) {
+			isSpawnBenchmark = 1;
+		} else if (!strcmp(argv[i], "--bullet-bench")) {
+			isBulletBenchmark = 1;
+		} else {
+			printf("Usage: %s [--server] [--connect host [--bot]] [--port port]\n", argv[0]);
+			printf("       [--pacing vsync|uncapped|capped|adaptive] [--fps cap] [--frames-in-flight n] [--stats]\n");
+			printf("       [--no-dynamic-resolution] [--resolution-scale min max]\n");
+			printf("       [--audio null|wav|aplay] [--audio-file file.wav] [--audio-bench]\n");
+			printf("       [--spawn-bench] [--bullet-bench]\n");
+			return -1;
+		}
+	}
+	if (isAudioBenchmark) {
+		return runAudioBenchmark();
+	}
+	if (isSpawnBenchmark) {
+		return runSpawnBenchmark();
+	}
+	if (isBulletBenchmark) {
+		return runBulletBenchmark();
+	}
+	if (isServer) {
+		return runServer(port);
+	}
+	int isClient = serverHost != NULL;
+	if (isClient && clientConnect(serverHost, port) != 0) {
+		return -1;
+	}
+	if (isClient && isBot) {
+		return runBot();
+	}
+
+	// Sound runs on its own thread, the game carries on silently if it can't start
+	startAudio();
+
 	// Initialize glfw
 	if (!glfwInit()) {
 		printf("GLFW init failed\n");
@@ -360,8 +3359,8 @@ int main(void)
 	// Create a fullscreen window and its OpenGL context
 	GLFWmonitor* monitor = glfwGetPrimaryMonitor();
 	const GLFWvidmode* videoMode = glfwGetVideoMode(monitor);
-	int screenWidth = videoMode->width;
-	int screenHeight = videoMode->height;
+	screenWidth = videoMode->width;
+	screenHeight = videoMode->height;
 	aspectRatio = (float)screenWidth/(float)screenHeight;
 	printf("Screen Resolution: %dx%d\n", screenWidth, screenHeight);
 	printf("Aspect Ratio: %f\n", aspectRatio);
@@ -377,19 +3376,23 @@ int main(void)
 	// Make the window's context current
 	glfwMakeContextCurrent(window);
 
-	// Turn on/off vsync
-	glfwSwapInterval(VSYNC_ON);
+	// Frame pacing (vsync etc.)
+	if (videoMode->refreshRate > 0) refreshRate = videoMode->refreshRate;
+	setPacingMode(pacingMode);
 
 	// Initialize glew
 	glewInit();
 
 	glViewport(0, 0, screenWidth, screenHeight);
+	if (isDynamicResolution) {
+		initDynamicResolution();
+	}
 
 	/* Player Data */
 	float playerVert[] = {
-		-0.04,	-0.04, 0.0,
-		0.04,	-0.04, 0.0,
-		0.0,	0.08, 0.0,
+		-0.04,	-0.04,
+		0.04,	-0.04,
+		0.0,	0.08,
 	};
 
 	unsigned int playerInd[] = {
@@ -397,6 +3400,7 @@ int main(void)
 	};
 
 	struct Object player = {
+		.type = TYPE_PLAYER,
 		.vertices = playerVert,
 		.indices = playerInd,
 		.verticesSize = sizeof(playerVert),
@@ -405,42 +3409,64 @@ int main(void)
 		.numInstances = 1,
 	};
 
+	// Everyone else in a multiplayer game, the local player is hidden
+	unsigned int otherPlayerInd[] = {
+		0, 1, 2,
+	};
+	float otherPlayerLocations[3*MAX_PLAYERS];
+	for (int i = 0; i < MAX_PLAYERS; i++) {
+		otherPlayerLocations[i*3] = 0.0;
+		otherPlayerLocations[i*3 + 1] = 1024;
+		otherPlayerLocations[i*3 + 2] = 0.0;
+	}
+	struct Object otherPlayers = {
+		.type = TYPE_RELATIVE,
+		.vertices = playerVert,
+		.indices = otherPlayerInd,
+		.instances = otherPlayerLocations,
+		.verticesSize = sizeof(playerVert),
+		.indicesSize = sizeof(otherPlayerInd),
+		.instancesSize = sizeof(otherPlayerLocations),
+		.drawMode = GL_LINE_LOOP,
+		.numInstances = MAX_PLAYERS,
+	};
+
 
 	/* Enemy Data */
 	float enemyVert[] = {
-		-0.05,	-0.2, 0.1,// Middle section
-		-0.1,	-0.15, 0.1, // (0 - 6)
-		-0.1,	0.3, 0.1,
-		0.0,	0.5, 0.1,
-		0.1,	0.3, 0.1,
-		0.1,	-0.15, 0.1,
-		0.05,	-0.2, 0.1,
-
-		-0.1,	-0.1, 0.1,// Left connector
-		-0.2,	-0.1, 0.1,// (7 - 10)
-		-0.1,	0.1, 0.1,
-		-0.2,	0.1, 0.1,
-
-		0.1,	-0.1, 0.1,// Right connector
-		0.2,	-0.1, 0.1,// (11 - 14)
-		0.1,	0.1, 0.1,
-		0.2,	0.1, 0.1,
-
-		-0.2,	-0.15, 0.1, // Left section
-		-0.2,	0.15, 0.1, // (15 - 19)
-		-0.25,	0.2, 0.1,
-		-0.3,	0.15, 0.1,
-		-0.3,	-0.15, 0.1,
-
-		0.2,	-0.15, 0.1, // Right section
-		0.2,	0.15, 0.1, // (20 - 24)
-		0.25,	0.2, 0.1,
-		0.3,	0.15, 0.1,
-		0.3,	-0.15, 0.1,
+		-0.05,	-0.2,// Middle section
+		-0.1,	-0.15, // (0 - 6)
+		-0.1,	0.3,
+		0.0,	0.5,
+		0.1,	0.3,
+		0.1,	-0.15,
+		0.05,	-0.2,
+
+		-0.1,	-0.1,// Left connector
+		-0.2,	-0.1,// (7 - 10)
+		-0.1,	0.1,
+		-0.2,	0.1,
+
+		0.1,	-0.1,// Right connector
+		0.2,	-0.1,// (11 - 14)
+		0.1,	0.1,
+		0.2,	0.1,
+
+		-0.2,	-0.15, // Left section
+		-0.2,	0.15, // (15 - 19)
+		-0.25,	0.2,
+		-0.3,	0.15,
+		-0.3,	-0.15,
+
+		0.2,	-0.15, // Right section
+		0.2,	0.15, // (20 - 24)
+		0.25,	0.2,
+		0.3,	0.15,
+		0.3,	-0.15,
 	};
-	for (int i = 0; i < sizeof(enemyVert)/3/sizeof(float); i++) {
-		enemyVert[3*i] *= 0.15;
-		enemyVert[3*i + 1] *= 0.15;
+	for (int i = 0; i < sizeof(enemyVert)/2/sizeof(float); i++) {
+		enemyVert[2*i] *= 0.15;
+		enemyVert[2*i + 1] *= 0.15;
 	}
 	unsigned int enemyInd[] = {
 		0, 1, // Middle section
@@ -468,68 +3494,51 @@ int main(void)
 		23, 24,
 		24, 20,
 	};
-	float enemyHealth[NUM_ENEMIES];
-	for (int i = 0; i < NUM_ENEMIES; i++) {
-		enemyHealth[i] = 1.0;
-	}
-
-	float enemyLocations[3*NUM_ENEMIES] = {
-		-4.0, 0.0, 0.0,
-		0.0, -4.0, 0.0,
-		4.0, 0.0, 0.0,
-		1.0, 3.0, 0.0,
-		0.0, 4.0, 0.0,
-		-1.0, 3.0, 0.0,
-	};
 	struct Object enemies = {
+		.type = TYPE_RELATIVE,
 		.vertices = enemyVert,
 		.indices = enemyInd,
-		.instances = enemyLocations,
+		.instances = game.enemyLocations,
 		.verticesSize = sizeof(enemyVert),
 		.indicesSize = sizeof(enemyInd),
-		.instancesSize = sizeof(enemyLocations),
+		.instancesSize = sizeof(game.enemyLocations),
 		.drawMode = GL_LINES,
-		.numInstances = NUM_ENEMIES,
+		.numInstances = MAX_ENEMIES, // Only the live ones get drawn, see the main loop
 	};
 
-	float timeSinceLastEnemyBullet[NUM_ENEMIES] = {0.0};
-
 	/* Wormhole Data */
-	float wormholeVert[3*WORMHOLE_SIDES];
+	float wormholeVert[2*WORMHOLE_SIDES];
 	unsigned int wormholeInd[WORMHOLE_SIDES];
-	createCircle(wormholeVert, wormholeInd, 0.2, WORMHOLE_SIDES);
+	createCircle(wormholeVert, wormholeInd, WORMHOLE_SIDES);
 
 	for (int i = 0; i < WORMHOLE_SIDES; i++) {
-		wormholeVert[3*i] *= 0.1;
-		wormholeVert[3*i + 1] *= 0.1;
+		wormholeVert[2*i] *= 0.1;
+		wormholeVert[2*i + 1] *= 0.1;
 	}
 
-	float wormholeInfo[3*NUM_WORMHOLES] = {
-		-4.0, 0.2, 0.0,
-		4.0, -0.2, 0.0,
-		0.0, 4.3, 0.0,
-	};
 	struct Object wormholes = {
+		.type = TYPE_WORMHOLE,
 		.vertices = wormholeVert,
 		.indices = wormholeInd,
-		.instances = wormholeInfo,
+		.instances = game.wormholeInfo,
 		.verticesSize = sizeof(wormholeVert),
 		.indicesSize = sizeof(wormholeInd),
-		.instancesSize = sizeof(wormholeInfo),
+		.instancesSize = sizeof(game.wormholeInfo),
 		.drawMode = GL_LINE_LOOP,
 		.numInstances = NUM_WORMHOLES,
 	};
 
 	/* Boundary Data */
-	float boundaryVert[3*BOUNDARY_SIDES];
+	float boundaryVert[2*BOUNDARY_SIDES];
 	unsigned int boundaryInd[BOUNDARY_SIDES];
-	createCircle(boundaryVert, boundaryInd, 0.3, BOUNDARY_SIDES);
+	createCircle(boundaryVert, boundaryInd, BOUNDARY_SIDES);
 
 	for (int i = 0; i < BOUNDARY_SIDES; i++) {
-		boundaryVert[3*i] *= BOUNDARY_RADIUS;
-		boundaryVert[3*i + 1] *= BOUNDARY_RADIUS;
+		boundaryVert[2*i] *= BOUNDARY_RADIUS;
+		boundaryVert[2*i + 1] *= BOUNDARY_RADIUS;
 	}
 	struct Object boundary = {
+		.type = TYPE_SINGLE,
 		.vertices = boundaryVert,
 		.indices = boundaryInd,
 		.verticesSize = sizeof(boundaryVert),
@@ -541,32 +3550,26 @@ int main(void)
 	/* Player Bullet Data */
 
 	float playerBulletVert[] = {
-		-0.03, 0.0, 0.1,
-		-0.03, 0.02, 0.1,
-		0.0, 0.0, 0.1,
-		0.0, 0.02, 0.1,
-		0.03, 0.0, 0.1,
-		0.03, 0.02, 0.1,
+		-0.03, 0.0,
+		-0.03, 0.02,
+		0.0, 0.0,
+		0.0, 0.02,
+		0.03, 0.0,
+		0.03, 0.02,
 	};
 	unsigned int playerBulletInd[] = {
 		0, 1,
 		2, 3,
 		4, 5,
 	};
-	float playerBulletLocations[3*NUM_PLAYER_BULLETS];
-	for (int i = 0; i < NUM_PLAYER_BULLETS; i++) {
-		playerBulletLocations[i*3] = 0.0;
-		playerBulletLocations[i*3 + 1] = 1024;
-		playerBulletLocations[i*3 + 2] = 0.0;
-	}
-	float playerBulletVelocities[2*NUM_PLAYER_BULLETS] = {0.0};
 	struct Object playerBullets = {
+		.type = TYPE_RELATIVE,
 		.vertices = playerBulletVert,
 		.indices = playerBulletInd,
-		.instances = playerBulletLocations,
+		.instances = game.playerBulletLocations,
 		.verticesSize = sizeof(playerBulletVert),
 		.indicesSize = sizeof(playerBulletInd),
-		.instancesSize = sizeof(playerBulletLocations),
+		.instancesSize = sizeof(game.playerBulletLocations),
 		.drawMode = GL_LINES,
 		.numInstances = NUM_PLAYER_BULLETS,
 	};
@@ -574,48 +3577,42 @@ int main(void)
 
 	/* Enemy Bullet Data */
 
-	float enemyBulletVert[3*ENEMY_BULLET_SIDES];
+	float enemyBulletVert[2*ENEMY_BULLET_SIDES];
 	unsigned int enemyBulletInd[ENEMY_BULLET_SIDES];
-	createCircle(enemyBulletVert, enemyBulletInd, 0.1, ENEMY_BULLET_SIDES);
+	createCircle(enemyBulletVert, enemyBulletInd, ENEMY_BULLET_SIDES);
 
 	for (int i = 0; i < ENEMY_BULLET_SIDES; i++) {
-		enemyBulletVert[3*i] *= ENEMY_BULLET_RAD;
-		enemyBulletVert[3*i + 1] *= ENEMY_BULLET_RAD;
+		enemyBulletVert[2*i] *= ENEMY_BULLET_RAD;
+		enemyBulletVert[2*i + 1] *= ENEMY_BULLET_RAD;
 	}
 
-	float enemyBulletLocations[3*NUM_ENEMY_BULLETS];
-	for (int i = 0; i < NUM_ENEMY_BULLETS; i++) {
-		enemyBulletLocations[i*3] = 0.0;
-		enemyBulletLocations[i*3 + 1] = 1024;
-		enemyBulletLocations[i*3 + 2] = 0.0;
-	}
-	float enemyBulletVelocities[2*NUM_ENEMY_BULLETS] = {0.0};
 	struct Object enemyBullets = {
+		.type = TYPE_RELATIVE,
 		.vertices = enemyBulletVert,
 		.indices = enemyBulletInd,
-		.instances = enemyBulletLocations,
+		.instances = game.enemyBulletLocations,
 		.verticesSize = sizeof(enemyBulletVert),
 		.indicesSize = sizeof(enemyBulletInd),
-		.instancesSize = sizeof(enemyBulletLocations),
+		.instancesSize = sizeof(game.enemyBulletLocations),
 		.drawMode = GL_TRIANGLE_FAN,
-		.numInstances = NUM_ENEMY_BULLETS,
+		.numInstances = MAX_ENEMY_BULLETS, // Only the live ones get drawn, see the main loop
 	};
 
 	/* Asteroid Data */
 
 	float asteroidVert[] = {
-		0.0, 0.02, 0.4,
-		0.009, 0.009, 0.4,
-		0.02, 0.0, 0.4,
-		0.017, -0.017, 0.4,
-		0.0, -0.01, 0.4,
-		-0.017, -0.017, 0.4,
-		-0.02, 0.0, 0.4,
-		-0.014, 0.014, 0.4,
+		0.0, 0.02,
+		0.009, 0.009,
+		0.02, 0.0,
+		0.017, -0.017,
+		0.0, -0.01,
+		-0.017, -0.017,
+		-0.02, 0.0,
+		-0.014, 0.014,
 	};
-	for (int i = 0; i < sizeof(asteroidVert)/sizeof(float)/3; i++) {
-		asteroidVert[i*3] *= 0.5;
-		asteroidVert[i*3 + 1] *= 0.5;
+	for (int i = 0; i < sizeof(asteroidVert)/sizeof(float)/2; i++) {
+		asteroidVert[i*2] *= 0.5;
+		asteroidVert[i*2 + 1] *= 0.5;
 	}
 	unsigned int asteroidInd[] = {
 		0, 1, 2, 3, 4, 5, 6, 7,
@@ -631,6 +3628,7 @@ int main(void)
 	}
 
 	struct Object asteroids = {
+		.type = TYPE_ASTEROID,
 		.vertices = asteroidVert,
 		.indices = asteroidInd,
 		.instances = asteroidInfo,
@@ -641,11 +3639,17 @@ int main(void)
 		.numInstances = NUM_ASTEROIDS,
 	};
 
-	unsigned int VAO;
-	glGenVertexArrays(1, &VAO);
-	glBindVertexArray(VAO);
+	if (!isClient) {
+		initGame();
+		spawnPlayer(localPlayer);
+		saveSnapshot();
+	}
+
+	glGenVertexArrays(1, &sceneVAO);
+	glBindVertexArray(sceneVAO);
 
 	addObject(&player);
+	addObject(&otherPlayers);
 	addObject(&enemies);
 	addObject(&playerBullets);
 	addObject(&enemyBullets);
@@ -656,6 +3660,9 @@ int main(void)
 
 	// Read shader code from files
 	unsigned int shader = createShaderFromFiles("vertex.shader", "fragment.shader");
+	hudShader = createShaderFromFiles("hudVertex.shader", "hudFragment.shader");
+	sceneShader = shader;
+	initHud();
 	glUseProgram(shader);
 
 	// Set Color
@@ -671,26 +3678,26 @@ int main(void)
 	int playerAngleLocation = glGetUniformLocation(shader, "playerAngle");
 	int playerLocation = glGetUniformLocation(shader, "playerLocation");
 	int aspectRatioLocation = glGetUniformLocation(shader, "aspectRatio");
-
-	unsigned int frameCount = 0;
+	int arenaExtentLocation = glGetUniformLocation(shader, "arenaExtent");
 
 	// Set Shader Variables
 	glUniform1f(aspectRatioLocation, aspectRatio);
+	glUniform1f(arenaExtentLocation, ARENA_EXTENT);
 	glUniform1f(timeUniformLocation, (float)glfwGetTime());
-	glUniform1f(playerAngleLocation, playerAngle);
-	glUniform2f(playerLocation, playerX, playerY);
+	glUniform1f(playerAngleLocation, game.playerLocations[localPlayer*3 + 2]);
+	glUniform2f(playerLocation, game.playerLocations[localPlayer*3], game.playerLocations[localPlayer*3 + 1]);
 
 	double lastTime = glfwGetTime();
-	double maxFPS = 0;
-	double minFPS = 1000000;
-	double avgFPS = 0;
-	float timeSinceLastBullet = 0.0;
+	double nextNetReport = lastTime + REPORT_INTERVAL;
+	double nextStatsReport = lastTime + REPORT_INTERVAL;
+	unsigned char lastLocalStatus = game.playerStatus[localPlayer];
+	int hasWon = 0;
 
 	// Enable Anti-Aliasing
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	glEnable(GL_BLEND);
 	glEnable(GL_LINE_SMOOTH);
-	glLineWidth(2.0);
+	glLineWidth(LINE_WIDTH);
 	glDepthMask(GL_FALSE);
 	glHint(GL_LINE_SMOOTH_HINT, GL_NICEST);
 
@@ -700,23 +3707,18 @@ int main(void)
 		// Render
 		render();
 
-		// Display FPS
+		// Frame timing
 		double curTime = glfwGetTime();
 		double deltaT = curTime - lastTime;
-		double fps = 1.0/deltaT;
-		maxFPS = (fps > maxFPS) ? fps : maxFPS;
-		minFPS = (fps < minFPS) ? fps : minFPS;
-		avgFPS = (avgFPS*frameCount + fps)/(frameCount+1);
-		frameCount++;
-//		printf("FPS: %.0f, MIN: %f, MAX: %F\n", avgFPS, minFPS, maxFPS);
-		if (frameCount >= 10) {
-			frameCount = 0;
-			avgFPS = 0;
-		}
 		lastTime = curTime;
+		recordFrameTime(deltaT);
+		if (showStats && curTime >= nextStatsReport) {
+			reportFrameTimes();
+			nextStatsReport += REPORT_INTERVAL;
+		}
 
 		// Handle Keyboard Input
-		handleKeyboardInput(deltaT, shader);
+		handleKeyboardInput(shader);
 
 		// Color fade
 		redShade += colorChangeRate*deltaT;
@@ -729,179 +3731,80 @@ int main(void)
 		}
 		glUniform4f(colorLocation, redShade, 0.0, 1.0, 1.0);
 
-		/* Player Rotation */
-		playerAngle += playerRotationRate*deltaT;
-		if (playerAngle >= 2*PI) {
-			playerAngle -= 2*PI;
-		};
-
-		/* Enemy Movement, Rotation and Shooting */
-		for (int i = 0; i < NUM_ENEMIES; i++) {
-			if (enemyLocations[i*3 + 1] == 1024) continue;
-			float enemySpeed = 0.5;
-			// Update Angle
-			float enemyAngle = enemyLocations[i*3 + 2];
-			float deltaX = playerX - enemyLocations[i*3];
-			float deltaY = playerY - enemyLocations[i*3 + 1];
-			enemyAngle = atan2(deltaX, deltaY);
-			enemyLocations[i*3 + 2] = enemyAngle;
-
-			// Update position and shoot if on screen
-			int enemyOnScreen = abs(deltaX) <= aspectRatio && abs(deltaY) <= 1.0;
-			if (enemyOnScreen) {
-				// Update Position
-				enemyLocations[i*3] += sin(enemyAngle)*enemySpeed*deltaT; // X
-				enemyLocations[i*3 + 1] += cos(enemyAngle)*enemySpeed*deltaT; // Y
-
-				// Shoot
-				timeSinceLastEnemyBullet[i] += deltaT;
-				if (timeSinceLastBullet >= 1.0/ENEMY_SHOOT_RATE) {
-					timeSinceLastBullet -= 1.0/ENEMY_SHOOT_RATE;
-				}
-			}
-		}
-
-		/* Player Bullet Movement */
-
-		// Check if each bullet is out of bounds
-		for (int i = 0; i < NUM_PLAYER_BULLETS; i++) {
-			float bulletX = playerBulletLocations[i*3];
-			float bulletY = playerBulletLocations[i*3 + 1];
-			if (!isOnScreen(bulletX, bulletY)) {
-				playerBulletLocations[i*3 + 1] = 1024;
+		if (isClient) {
+			// The server runs the game, we only send input and predict our own ship
+			clientUpdate(deltaT, localInput);
+			if (curTime >= nextNetReport) {
+				clientReport(REPORT_INTERVAL);
+				nextNetReport += REPORT_INTERVAL;
 			}
-		}
-
-		// Add new bullet
-		if (isShooting) {
-			timeSinceLastBullet += deltaT;
-		}
-		if (timeSinceLastBullet >= 1.0/PLAYER_SHOOT_RATE) {
-			timeSinceLastBullet -= 1.0/PLAYER_SHOOT_RATE;
-			spawnBullet(playerBulletLocations, playerBulletVelocities, NUM_PLAYER_BULLETS, playerX, playerY, playerAngle, deltaT, 4.0);
-		}
-
-		// Move Bullets
-		for (int i = 0; i < NUM_PLAYER_BULLETS; i++) {
-			playerBulletLocations[i*3] += playerBulletVelocities[i*2];
-			playerBulletLocations[i*3 + 1] += playerBulletVelocities[i*2 + 1];
-		}
-
-		/* Enemy Bullet Movement */
-
-		// Check if each bullet is out of bounds
-		for (int i = 0; i < NUM_ENEMY_BULLETS; i++) {
-			float bulletX = enemyBulletLocations[i*3];
-			float bulletY = enemyBulletLocations[i*3 + 1];
-			if (!isOnScreen(bulletX, bulletY)) {
-				enemyBulletLocations[i*3 + 1] = 1024;
+		} else if (isRewinding) {
+			// Step back through the snapshot ring, stopping at the oldest one
+			// (this can undo a death or a win too)
+			if (numSnapshots > 1) discardSnapshots(1);
+			restoreSnapshot(0);
+			hasWon = 0;
+		} else if (isRetrying && (hasWon || game.playerStatus[localPlayer] != PLAYER_ALIVE)) {
+			initGame();
+			spawnPlayer(localPlayer);
+			saveSnapshot();
+			hasWon = 0;
+		} else if (!hasWon && game.playerStatus[localPlayer] == PLAYER_ALIVE) {
+			playerInputs[localPlayer] = localInput;
+			if (updateGame(deltaT)) {
+				printf("You Win!\n");
+				hasWon = 1;
 			}
+			saveSnapshot();
 		}
 
-		// Add new bullet
-		for (int i = 0; i < NUM_ENEMIES; i++) {
-			if (enemyLocations[i*3 + 1] == 1024) continue;
-			float enemyX = enemyLocations[i*3];
-			float enemyY = enemyLocations[i*3 + 1];
-			float enemyAngle = enemyLocations[i*3 + 2];
-			if (isOnScreen(enemyX, enemyY)) {
-				timeSinceLastEnemyBullet[i] += deltaT;
-			}
-
-			if (timeSinceLastEnemyBullet[i] >= 1.0/ENEMY_SHOOT_RATE) {
-				timeSinceLastEnemyBullet[i] -= 1.0/ENEMY_SHOOT_RATE;
-				spawnBullet(enemyBulletLocations, enemyBulletVelocities, NUM_ENEMY_BULLETS, enemyX, enemyY, enemyAngle, deltaT, 1.0);
-			}
+		/* Win/Lose Game Detection */
+		unsigned char localStatus = game.playerStatus[localPlayer];
+		if (localStatus != lastLocalStatus) {
+			if (localStatus == PLAYER_OUT_OF_BOUNDS) printf("Out of Bounds\n");
+			if (localStatus == PLAYER_DEAD) printf("You Died\n");
+			lastLocalStatus = localStatus;
 		}
 
-
-		// Move Bullets
-		for (int i = 0; i < NUM_ENEMY_BULLETS; i++) {
-			enemyBulletLocations[i*3] += enemyBulletVelocities[i*2];
-			enemyBulletLocations[i*3 + 1] += enemyBulletVelocities[i*2 + 1];
+		/* HUD */
+		updateHud(deltaT, curTime);
+		if (isClient) {
+			// In multiplayer the server starts a new round, so keep going
+			setHudText(&messageText, (localStatus == PLAYER_ALIVE) ? "" : "WAITING FOR NEXT ROUND");
+			setHudText(&subMessageText, "");
+		} else {
+			char *message = "";
+			if (hasWon) message = "YOU WIN!";
+			if (localStatus == PLAYER_DEAD) message = "YOU DIED";
+			if (localStatus == PLAYER_OUT_OF_BOUNDS) message = "OUT OF BOUNDS";
+			setHudText(&messageText, message);
+			setHudText(&subMessageText, (message[0] != '\0') ? "R TO RETRY  BACKSPACE TO REWIND" : "");
 		}
 
 		/* Set Shader Variables */
+		float *localLocation = &game.playerLocations[localPlayer*3];
 		glUniform1f(timeUniformLocation, (float)curTime);
-		glUniform2f(playerLocation, playerX, playerY);
-		glUniform1f(playerAngleLocation, playerAngle);
+		glUniform2f(playerLocation, localLocation[0], localLocation[1]);
+		glUniform1f(playerAngleLocation, localLocation[2]);
 
 		/* Object Updates */
+		for (int i = 0; i < MAX_PLAYERS; i++) {
+			int isVisible = i != localPlayer && game.playerStatus[i] == PLAYER_ALIVE;
+			otherPlayerLocations[i*3] = game.playerLocations[i*3];
+			otherPlayerLocations[i*3 + 1] = isVisible ? game.playerLocations[i*3 + 1] : 1024;
+			otherPlayerLocations[i*3 + 2] = game.playerLocations[i*3 + 2];
+		}
+		updateObject(&otherPlayers);
+		enemies.numInstances = game.numEnemies;
 		updateObject(&enemies);
 		updateObject(&playerBullets);
+		enemyBullets.numInstances = game.numEnemyBullets;
 		updateObject(&enemyBullets);
-
-		/* Collision Detection */
-
-		// Out of Bounds Detection
-		if ((playerX*playerX + playerY*playerY) >= BOUNDARY_RADIUS*BOUNDARY_RADIUS) {
-			printf("Out of Bounds\n");
-			exit(0);
-		}
-
-		// Enemy and Player / Player Bullet
-		for (int enemy = 0; enemy < NUM_ENEMIES; enemy++) {
-			if (enemyLocations[enemy*3 + 1] == 1024) continue;
-			float enemyX = enemyLocations[enemy*3];
-			float enemyY = enemyLocations[enemy*3 + 1];
-			float deltaX = enemyX - playerX;
-			float deltaY = enemyY - playerY;
-
-			// Collision with Player
-			float disFromPlayer = sqrt(deltaX*deltaX + deltaY*deltaY);
-			if (disFromPlayer <= PLAYER_HITBOX_RAD + ENEMY_HITBOX_RAD) {
-				enemyLocations[enemy*3 + 1] = 1024;
-				enemyHealth[enemy] = 0.0;
-				playerHealth -= 0.5;
-			}
-
-			for (int bullet = 0; bullet < NUM_PLAYER_BULLETS; bullet++) {
-				if (playerBulletLocations[bullet*3 + 1] == 1024) continue;
-				float bulletX = playerBulletLocations[bullet*3];
-				float bulletY = playerBulletLocations[bullet*3 + 1];
-				float deltaX = enemyX - bulletX;
-				float deltaY = enemyY - bulletY;
-				int isCollide = sqrt(deltaX*deltaX + deltaY*deltaY) <= ENEMY_HITBOX_RAD + PLAYER_BULLET_HITBOX_RAD;
-				if (isCollide) {
-					enemyHealth[enemy] -= 0.1;
-					playerBulletLocations[bullet*3 + 1] = 1024;
-				}
-			}
-			if (enemyHealth[enemy] <= 0.0) {
-				enemyLocations[enemy*3 + 1] = 1024;
-			}
-		}
-
-		// Player and Enemy Bullet
-		for (int bullet = 0; bullet < NUM_ENEMY_BULLETS; bullet++) {
-			if (enemyBulletLocations[bullet*3 + 1] == 1024) continue;
-			float bulletX = enemyBulletLocations[bullet*3];
-			float bulletY = enemyBulletLocations[bullet*3 + 1];
-			float deltaX = playerX - bulletX;
-			float deltaY = playerY - bulletY;
-			int isCollide = sqrt(deltaX*deltaX + deltaY*deltaY) <= PLAYER_HITBOX_RAD + ENEMY_BULLET_RAD;
-			if (isCollide) {
-				playerHealth -= 0.25;
-				enemyBulletLocations[bullet*3 + 1] = 1024;
-			}
-		}
-
-		/* Win/Lose Game Detection */
-		if (playerHealth <= 0.0) {
-			printf("You Died\n");
-			exit(0);
-		}
-		int youWin = 1;
-		for (int enemy = 0; enemy <= NUM_ENEMIES; enemy++) {
-			if (enemyHealth[enemy] > 0.0 && enemyLocations[enemy*3 + 1] != 1024) youWin = 0;
-		}
-		if (youWin) {
-			printf("You Win!\n");
-			exit(0);
-		}
+		updateObject(&wormholes);
 	}
 
 	glDeleteProgram(shader);
+	glDeleteProgram(hudShader);
 
 	glfwTerminate();
 	return 0;
@@ -1,10 +1,12 @@
 #version 330 core
 
-layout (location = 0) in vec4 position;
-layout (location = 1) in vec3 info;
-//layout (location = 2) in float rotation;
+layout (location = 0) in vec2 meshPosition; // Half float
+layout (location = 1) in vec2 instancePosition; // Normalized 16-bit fixed point
+layout (location = 2) in uint type; // Unsigned byte
+layout (location = 3) in float instanceAngle; // Normalized 16-bit, fraction of a turn
 
 uniform float time;
+uniform float arenaExtent;
 uniform float aspectRatio;
 
 uniform vec2 playerLocation;
@@ -23,27 +25,28 @@ mat4 rotate(float angle)
 
 void main()
 {
-	int type = int(position[2]*10.0);
+	vec4 position = vec4(meshPosition, 0.0, 1.0);
+	vec3 info = vec3(instancePosition*arenaExtent, instanceAngle*6.28318530718);
 	switch (type) {
-	case 0: // Player
+	case 0u: // Player
 		gl_Position = rotate(playerAngle)*position;
 		break;
-	case 1: // Relative to player
+	case 1u: // Relative to player
 		gl_Position = rotate(info[2])*position;
 		gl_Position[0] += info[0] - playerLocation[0];
 		gl_Position[1] += info[1] - playerLocation[1];
 		break;
-	case 2: // Wormhole
+	case 2u: // Wormhole
 		gl_Position = rotate(time*64.0)*position;
 		gl_Position[0] += info[0] - playerLocation[0];
 		gl_Position[1] += info[1] - playerLocation[1];
 		break;
-	case 3: // Relative to player (single instance)
+	case 3u: // Relative to player (single instance)
 		gl_Position = position;
 		gl_Position[0] -= playerLocation[0];
 		gl_Position[1] -= playerLocation[1];
 		break;
-	case 4: // Asteroids
+	case 4u: // Asteroids
 		float rotationRate = (gl_InstanceID%16-8)/4.0;
 		gl_Position = rotate(rotationRate*time + info[2])*position;
 		gl_Position[0] += info[0] - playerLocation[0];